@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Orphan-storm benchmark: runs orphan-storm under tinyreaper in each event loop
+# mode and prints one JSON line per mode:
+#
+#   {"mode":"signalfd","storm":"-n 1000 -b 10 -i 100 -l 0","wall_ms":1234,
+#    "reaped":10001,"reaps_per_sec":9000,"peak_backlog":812,"peak_batch":256,
+#    "latency_us":{"p50":...,"p90":...,"p99":...,"max":...},
+#    "cpu_ms":12,"maxrss_kb":1800}
+#
+# reaps_per_sec is measured from the first to the last reap; peak_backlog is the
+# largest number of zombies collected in one reap pass, i.e. the peak backlog as
+# seen by the reaper. peak_batch is the largest batch within a pass, which is
+# capped at the batch size (256). cpu_ms is tinyreaper's own user+system time.
+#
+# Environment:
+#   TINYREAPER   tinyreaper binary (default: ../tinyreaper)
+#   STORM        orphan-storm arguments (default: -n 1000 -b 10 -i 100 -l 0)
+#   MODES        modes to run (default: signalfd pidfd cgroup)
+#   RUNS         runs per mode (default: 1)
+
+cd "$(dirname "$0")" || exit 1
+
+TINYREAPER=${TINYREAPER:-../tinyreaper}
+STORM=${STORM:--n 1000 -b 10 -i 100 -l 0}
+MODES=${MODES:-signalfd pidfd cgroup}
+RUNS=${RUNS:-1}
+
+log=$(mktemp) || exit 1
+trap 'rm -f "$log"' EXIT
+
+now_ms() {
+	date +%s%3N
+}
+
+for mode in $MODES; do
+	case $mode in
+		signalfd) flag= ;;
+		pidfd) flag=--pidfd ;;
+		cgroup) flag=--cgroup ;;
+		*) echo "bench.sh: unknown mode $mode" >&2; exit 1 ;;
+	esac
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		run=$((run + 1))
+		start=$(now_ms)
+		# shellcheck disable=SC2086
+		"$TINYREAPER" $flag --log-summary=10s --report=json -- ./orphan-storm -q $STORM > "$log" 2>&1
+		rc=$?
+		wall=$(($(now_ms) - start))
+		report=$(grep '^tinyreaper: report {' "$log" | tail -n 1)
+		if [ $rc -ne 0 ] || [ -z "$report" ]; then
+			echo "bench.sh: $mode: tinyreaper failed (rc $rc), skipped" >&2
+			continue
+		fi
+		echo "$report" | sed 's/^tinyreaper: report {//; s/}$//' | awk -v mode="$mode" -v storm="$STORM" -v wall="$wall" '
+		{
+			n = split($0, f, /[,:{}]/)
+			for (i = 1; i < n; i ++) {
+				key = f[i]; gsub(/"/, "", key)
+				if (key != "" && f[i + 1] ~ /^[0-9]+$/) {
+					v[key] = f[i + 1]
+				}
+			}
+			rate = v["reaping_ms"] > 0 ? int(v["reaped"] * 1000 / v["reaping_ms"]) : v["reaped"]
+			printf("{\"mode\":\"%s\",\"storm\":\"%s\",\"wall_ms\":%d,\"reaped\":%d,\"reaps_per_sec\":%d,\"peak_backlog\":%d,\"peak_batch\":%d,", \
+			       mode, storm, wall, v["reaped"], rate, v["peak_backlog"], v["peak_batch"])
+			printf("\"latency_us\":{\"p50\":%d,\"p90\":%d,\"p99\":%d,\"max\":%d},", v["p50"], v["p90"], v["p99"], v["max"])
+			printf("\"cpu_ms\":%d,\"maxrss_kb\":%d}\n", v["utime_ms"] + v["stime_ms"], v["maxrss_kb"])
+		}'
+	done
+done
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# RSS budget check: runs tinyreaper under an orphan storm and fails if its
+# resident set exceeds the budget once it reached steady state (after the
+# first second).
+#
+# Environment:
+#   TINYREAPER       tinyreaper binary (default: ../tinyreaper-tiny)
+#   RSS_BUDGET_KB    budget in KB (default: 1024)
+#   STORM            orphan-storm arguments (default: -n 200 -b 30 -i 100 -l 0-200)
+#   OPTIONS          tinyreaper options (default: --log-summary)
+
+cd "$(dirname "$0")" || exit 1
+
+TINYREAPER=${TINYREAPER:-../tinyreaper-tiny}
+RSS_BUDGET_KB=${RSS_BUDGET_KB:-1024}
+STORM=${STORM:--n 200 -b 30 -i 100 -l 0-200}
+OPTIONS=${OPTIONS:---log-summary}
+
+# shellcheck disable=SC2086
+"$TINYREAPER" $OPTIONS -- ./orphan-storm -q $STORM > /dev/null 2>&1 &
+pid=$!
+
+sleep 1
+peak=0
+samples=0
+while rss=$(awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status" 2>/dev/null) && [ -n "$rss" ]; do
+	[ "$rss" -gt "$peak" ] && peak=$rss
+	samples=$((samples + 1))
+	sleep 0.1
+done
+wait $pid
+
+if [ $samples -eq 0 ]; then
+	echo "check-rss: $TINYREAPER exited before reaching steady state" >&2
+	exit 1
+fi
+echo "check-rss: $TINYREAPER $OPTIONS: peak RSS ${peak}K in $samples samples, budget ${RSS_BUDGET_KB}K"
+[ "$peak" -le "$RSS_BUDGET_KB" ]
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Shutdown escalation check: runs tinyreaper with a command that ignores
+# SIGTERM, sends it SIGTERM and fails unless it escalates to SIGKILL and exits
+# within the expected time. Covers --grace=0, which must escalate right away.
+#
+# Environment:
+#   TINYREAPER   tinyreaper binary (default: ../tinyreaper)
+
+cd "$(dirname "$0")" || exit 1
+
+TINYREAPER=${TINYREAPER:-../tinyreaper}
+log=$(mktemp) || exit 1
+trap 'rm -f "$log"' EXIT
+failed=0
+
+# check <max ms> <tinyreaper options>
+check() {
+	max_ms=$1
+	shift
+	# shellcheck disable=SC2086
+	"$TINYREAPER" "$@" -- sh -c 'trap "" TERM; sleep 60 & wait' > "$log" 2>&1 &
+	pid=$!
+	sleep 0.3
+	start=$(date +%s%3N)
+	kill -TERM $pid
+	# the outer bound, should tinyreaper hang
+	( exec 2> /dev/null; sleep $((max_ms / 1000 + 5)) && kill -KILL $pid ) &
+	watchdog=$!
+	wait $pid
+	rc=$?
+	ms=$(($(date +%s%3N) - start))
+	pkill -P $watchdog 2> /dev/null
+	if [ $ms -gt "$max_ms" ] || ! grep -q "Killing children" "$log"; then
+		echo "check-shutdown: $*: FAILED (rc $rc after ${ms}ms, limit ${max_ms}ms)" >&2
+		cat "$log" >&2
+		failed=1
+	else
+		echo "check-shutdown: $*: ok (rc $rc after ${ms}ms)"
+	fi
+}
+
+check 500 --grace=0 --kill
+check 500 --grace=0 --kill=100ms
+check 1500 --grace=1s --kill
+check 500 --pidfd --grace=0 --kill
+
+exit $failed
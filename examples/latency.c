@@ -0,0 +1,333 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Latency harness for tinyreaper, measuring across repeated runs
+//
+//  - startup: from exec'ing tinyreaper to the command's main()
+//  - shutdown: from SIGTERM to the exit of tinyreaper, with <n> descendants
+//    that are cooperative (die on SIGTERM), slow (take 200ms to exit),
+//    ignoring (ignore SIGTERM, need SIGKILL) or setsid'd (escaped the process
+//    group, die on SIGTERM)
+//
+// and printing one JSON line per scenario with the distribution in
+// microseconds. Options after -- are passed to tinyreaper, e.g. --pidfd,
+// --cgroup, --grace=500ms or --stagger=... to compare modes and escalation
+// timings.
+//
+// Internally, the same binary serves as the command (--command) and its
+// descendants. We are a child subreaper, so descendants which outlive
+// tinyreaper (e.g. ignoring SIGTERM without --kill) are handed to us; they
+// are killed after each run.
+
+static const char* tinyreaper = "../tinyreaper";
+static char self[4096]; // our own binary, run as the command
+
+static const char* const known_scenarios[] = { "cooperative", "slow", "ignoring", "setsid", NULL };
+static int runs = 20;
+static int num_descendants = 100;
+static char options[1024] = ""; // tinyreaper options, for the output
+static long survivors_killed = 0;
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void write_full(int fd, const void* data, size_t len) {
+	while (len > 0) {
+		const ssize_t n = write(fd, data, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			_exit(1);
+		}
+		data = (const char*)data + n;
+		len -= (size_t)n;
+	}
+}
+
+static int read_full(int fd, void* data, size_t len) {
+	while (len > 0) {
+		const ssize_t n = read(fd, data, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		data = (char*)data + n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+////////////////// command side ////////////////////////////////////
+
+static void handle_slow_term(int sig) {
+	(void)sig;
+	const struct timespec ts = { 0, 200 * 1000000 };
+	nanosleep(&ts, NULL);
+	_exit(0);
+}
+
+// Runs as the command: reports when main() was reached, forks the descendants,
+// reports once they are all set up, then waits to be terminated.
+static int run_command(int fd, const char* scenario, int n) {
+	const uint64_t started = now_us();
+	write_full(fd, &started, sizeof(started));
+	for (int i = 0; i < n; i ++) {
+		pid_t c = fork();
+		if (c == -1) {
+			perror("fork");
+			return 1;
+		}
+		if (c == 0) {
+			if (strcmp(scenario, "slow") == 0) {
+				signal(SIGTERM, handle_slow_term);
+			} else if (strcmp(scenario, "ignoring") == 0) {
+				signal(SIGTERM, SIG_IGN);
+			} else if (strcmp(scenario, "setsid") == 0) {
+				setsid();
+			}
+			const char ready = 1;
+			write_full(fd, &ready, 1);
+			close(fd);
+			for (;;) {
+				pause();
+			}
+		}
+	}
+	close(fd);
+	for (;;) {
+		pause();
+	}
+	return 0;
+}
+
+////////////////// harness side ////////////////////////////////////
+
+// Starts tinyreaper with <extra> options, running us as the command.
+static pid_t start_tinyreaper(char** extra, int num_extra, const char* scenario, int n, int* fd) {
+	int p[2];
+	if (pipe(p) == -1) {
+		perror("pipe");
+		exit(-1);
+	}
+	char fd_arg[16];
+	char n_arg[16];
+	snprintf(fd_arg, sizeof(fd_arg), "%d", p[1]);
+	snprintf(n_arg, sizeof(n_arg), "%d", n);
+	const char* argv[64];
+	int argc = 0;
+	argv[argc ++] = tinyreaper;
+	for (int i = 0; i < num_extra && argc < 56; i ++) {
+		argv[argc ++] = extra[i];
+	}
+	argv[argc ++] = "--";
+	argv[argc ++] = self;
+	argv[argc ++] = "--command";
+	argv[argc ++] = fd_arg;
+	argv[argc ++] = scenario;
+	argv[argc ++] = n_arg;
+	argv[argc] = NULL;
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(-1);
+	}
+	if (pid == 0) {
+		close(p[0]);
+		// tinyreaper's log is not what we measure
+		const int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+		close(null_fd);
+		const uint64_t exec_us = now_us();
+		write_full(p[1], &exec_us, sizeof(exec_us));
+		execv(tinyreaper, (char**)argv);
+		perror(tinyreaper);
+		_exit(127);
+	}
+	close(p[1]);
+	*fd = p[0];
+	return pid;
+}
+
+// Kills and reaps whatever was handed to us. Killing by pid is safe: our
+// children's pids cannot be reused before we reap them.
+static void kill_survivors() {
+	char path[64];
+	char buf[64 * 1024];
+	snprintf(path, sizeof(path), "/proc/self/task/%d/children", (int)getpid());
+	for (;;) {
+		const int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			perror(path);
+			exit(-1);
+		}
+		ssize_t len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		buf[len > 0 ? len : 0] = '\0';
+		int killed = 0;
+		for (char* p = buf; ; ) {
+			char* end;
+			const long pid = strtol(p, &end, 10);
+			if (end == p) {
+				break;
+			}
+			kill((pid_t)pid, SIGKILL);
+			killed ++;
+			p = end;
+		}
+		if (killed == 0) {
+			break;
+		}
+		survivors_killed += killed;
+		while (waitpid(-1, NULL, 0) != -1 || errno == EINTR);
+	}
+}
+
+static int compare_us(const void* a, const void* b) {
+	const uint64_t x = *(const uint64_t*)a;
+	const uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_distribution(const char* what, const char* scenario, int n, uint64_t* us, int count) {
+	if (count == 0) {
+		return;
+	}
+	qsort(us, (size_t)count, sizeof(us[0]), compare_us);
+	uint64_t sum = 0;
+	for (int i = 0; i < count; i ++) {
+		sum += us[i];
+	}
+	printf("{\"measure\":\"%s\",\"options\":\"%s\",\"scenario\":\"%s\",\"descendants\":%d,\"runs\":%d,"
+	       "\"us\":{\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"max\":%llu,\"mean\":%llu}}\n",
+	       what, options, scenario, n, count,
+	       (unsigned long long)us[0], (unsigned long long)us[count / 2],
+	       (unsigned long long)us[(count * 9) / 10], (unsigned long long)us[count - 1],
+	       (unsigned long long)(sum / (uint64_t)count));
+	fflush(stdout);
+}
+
+// One run: start, wait until all descendants are set up, SIGTERM, wait for exit.
+static int measure(char** extra, int num_extra, const char* scenario, int n,
+                   uint64_t* startup_us, uint64_t* shutdown_us) {
+	int fd;
+	const pid_t pid = start_tinyreaper(extra, num_extra, scenario, n, &fd);
+	uint64_t exec_us, started_us;
+	int ok = read_full(fd, &exec_us, sizeof(exec_us)) == 0 &&
+	         read_full(fd, &started_us, sizeof(started_us)) == 0;
+	for (int i = 0; ok && i < n; i ++) {
+		char c;
+		ok = read_full(fd, &c, 1) == 0;
+	}
+	close(fd);
+	const uint64_t term_us = now_us();
+	kill(pid, SIGTERM);
+	int status;
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+	const uint64_t exit_us = now_us();
+	kill_survivors();
+	if (!ok) {
+		fprintf(stderr, "latency: %s run failed (status %d)\n", scenario, status);
+		return -1;
+	}
+	*startup_us = started_us - exec_us;
+	*shutdown_us = exit_us - term_us;
+	return 0;
+}
+
+static void print_usage() {
+	printf("Use: latency [-r <runs>] [-n <descendants>] [-t <tinyreaper>] [-s <scenarios>] [-- <tinyreaper options>]\n");
+	printf("\n");
+	printf("<scenarios>: comma separated list of cooperative, slow, ignoring, setsid (default: all)\n");
+	printf("Defaults: -r 20 -n 100 -t ../tinyreaper\n");
+}
+
+int main(int argc, char** argv) {
+	if (argc == 5 && strcmp(argv[1], "--command") == 0) {
+		return run_command(atoi(argv[2]), argv[3], atoi(argv[4]));
+	}
+	char scenarios[256] = "cooperative,slow,ignoring,setsid";
+	int opt;
+	while ((opt = getopt(argc, argv, "r:n:t:s:h")) != -1) {
+		switch (opt) {
+		case 'r': runs = atoi(optarg); break;
+		case 'n': num_descendants = atoi(optarg); break;
+		case 't': tinyreaper = optarg; break;
+		case 's': snprintf(scenarios, sizeof(scenarios), "%s", optarg); break;
+		default:
+			print_usage();
+			exit(opt == 'h' ? 0 : -1);
+		}
+	}
+	if (runs <= 0 || num_descendants < 0) {
+		print_usage();
+		exit(-1);
+	}
+	char** extra = argv + optind;
+	const int num_extra = argc - optind;
+	for (int i = 0; i < num_extra; i ++) {
+		const size_t used = strlen(options);
+		snprintf(options + used, sizeof(options) - used, "%s%s", i > 0 ? " " : "", extra[i]);
+	}
+
+	const ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len <= 0) {
+		perror("/proc/self/exe");
+		exit(-1);
+	}
+	self[len] = '\0';
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+		perror("PR_SET_CHILD_SUBREAPER");
+		exit(-1);
+	}
+
+	// Startup does not depend on the scenario; we collect it over all runs.
+	int num_scenarios = 0;
+	const char* selected[64];
+	for (char* s = strtok(scenarios, ","); s != NULL && num_scenarios < 64; s = strtok(NULL, ",")) {
+		int known = 0;
+		for (int i = 0; known_scenarios[i] != NULL; i ++) {
+			known |= strcmp(s, known_scenarios[i]) == 0;
+		}
+		if (!known) {
+			fprintf(stderr, "latency: unknown scenario %s\n", s);
+			exit(-1);
+		}
+		selected[num_scenarios ++] = s;
+	}
+	uint64_t* startup = calloc((size_t)runs * num_scenarios, sizeof(uint64_t));
+	uint64_t* shutdown = calloc((size_t)runs, sizeof(uint64_t));
+	int num_startup = 0;
+	for (int s = 0; s < num_scenarios; s ++) {
+		int count = 0;
+		for (int r = 0; r < runs; r ++) {
+			if (measure(extra, num_extra, selected[s], num_descendants, startup + num_startup, shutdown + count) == 0) {
+				num_startup ++;
+				count ++;
+			}
+		}
+		print_distribution("shutdown", selected[s], num_descendants, shutdown, count);
+	}
+	print_distribution("startup", "all", num_descendants, startup, num_startup);
+	if (survivors_killed > 0) {
+		fprintf(stderr, "latency: killed %ld descendants which outlived tinyreaper\n", survivors_killed);
+	}
+	return 0;
+}
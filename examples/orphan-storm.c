@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Load generator for benchmarking tinyreaper (see bench.sh): creates bursts of
+// orphans. Each burst is forked by a short-lived burst parent, which exits
+// right away, so its children are orphaned and adopted by the reaper. We exit
+// once all orphans are gone.
+
+static void print_usage() {
+	printf("Use: orphan-storm [-n <orphans per burst>] [-b <bursts>] [-i <burst interval ms>]\n");
+	printf("                  [-l <lifetime>] [-s <percent setsid>] [-q]\n");
+	printf("\n");
+	printf("<lifetime> is in milliseconds: <ms> (fixed), <min>-<max> (uniform) or exp<mean> (exponential).\n");
+	printf("Defaults: -n 1000 -b 10 -i 100 -l 0\n");
+}
+
+static int num_orphans = 1000;
+static int num_bursts = 10;
+static long interval_ms = 100;
+static int setsid_percent = 0;
+static int quiet = 0;
+
+enum distribution { FIXED, UNIFORM, EXPONENTIAL };
+static enum distribution distribution = FIXED;
+static long lifetime_ms = 0; // fixed, min, or mean
+static long lifetime_max_ms = 0;
+
+static uint64_t random_state = 0;
+
+static uint64_t next_random() {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+static long pick_lifetime_ms() {
+	switch (distribution) {
+	case UNIFORM:
+		return lifetime_ms + (long)(next_random() % (uint64_t)(lifetime_max_ms - lifetime_ms + 1));
+	case EXPONENTIAL: {
+		// inverse transform sampling; u in (0, 1]
+		const double u = (double)((next_random() >> 11) + 1) / (double)(1ull << 53);
+		return (long)(-log(u) * (double)lifetime_ms);
+	}
+	default:
+		return lifetime_ms;
+	}
+}
+
+static void sleep_ms(long ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static int parse_lifetime(const char* s) {
+	char* end;
+	if (strncmp(s, "exp", 3) == 0) {
+		distribution = EXPONENTIAL;
+		lifetime_ms = strtol(s + 3, &end, 10);
+		return *end == '\0' && lifetime_ms > 0 ? 0 : -1;
+	}
+	lifetime_ms = strtol(s, &end, 10);
+	if (*end == '-') {
+		distribution = UNIFORM;
+		lifetime_max_ms = strtol(end + 1, &end, 10);
+		return *end == '\0' && lifetime_max_ms >= lifetime_ms ? 0 : -1;
+	}
+	return *end == '\0' && lifetime_ms >= 0 ? 0 : -1;
+}
+
+static void burst(int burst_no) {
+	pid_t parent = fork();
+	if (parent == -1) {
+		perror("fork");
+		exit(-1);
+	}
+	if (parent > 0) {
+		while (waitpid(parent, NULL, 0) == -1 && errno == EINTR);
+		return;
+	}
+	// burst parent
+	random_state ^= (uint64_t)getpid() << 20 | (uint64_t)burst_no;
+	for (int i = 0; i < num_orphans; i ++) {
+		const long lifetime = pick_lifetime_ms();
+		const int escape = (int)(next_random() % 100) < setsid_percent;
+		pid_t c = fork();
+		if (c == 0) {
+			// Orphan: holds the write end of the alive pipe until it exits.
+			if (escape) {
+				setsid();
+			}
+			if (lifetime > 0) {
+				sleep_ms(lifetime);
+			}
+			_exit(0);
+		} else if (c == -1) {
+			fprintf(stderr, "orphan-storm: fork failed after %d orphans: %s\n", i, strerror(errno));
+			break;
+		}
+	}
+	_exit(0);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:b:i:l:s:qh")) != -1) {
+		switch (opt) {
+		case 'n': num_orphans = atoi(optarg); break;
+		case 'b': num_bursts = atoi(optarg); break;
+		case 'i': interval_ms = atol(optarg); break;
+		case 's': setsid_percent = atoi(optarg); break;
+		case 'q': quiet = 1; break;
+		case 'l':
+			if (parse_lifetime(optarg) == 0) {
+				break;
+			}
+			// fall through
+		default:
+			print_usage();
+			exit(opt == 'h' ? 0 : -1);
+		}
+	}
+	if (num_orphans < 0 || num_bursts < 0 || interval_ms < 0 || setsid_percent < 0 || setsid_percent > 100) {
+		print_usage();
+		exit(-1);
+	}
+
+	// Every orphan inherits the write end; once all of them exited, we read EOF.
+	int alive[2];
+	if (pipe(alive) == -1) {
+		perror("pipe");
+		exit(-1);
+	}
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	random_state = (uint64_t)start.tv_nsec | 1;
+	for (int b = 0; b < num_bursts; b ++) {
+		if (b > 0 && interval_ms > 0) {
+			sleep_ms(interval_ms);
+		}
+		burst(b);
+	}
+	close(alive[1]);
+	char c;
+	while (read(alive[0], &c, 1) == -1 && errno == EINTR);
+
+	if (!quiet) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		const long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+		printf("orphan-storm: %d orphans in %d bursts, done after %ldms\n", num_orphans * num_bursts, num_bursts, ms);
+	}
+	return 0;
+}
@@ -1,183 +1,4837 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/mempolicy.h>
 #include <errno.h>
-#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
+// USDT probes (provider "tinyreaper") for bpftrace and perf, e.g.
+//   bpftrace -e 'usdt:./tinyreaper:tinyreaper:reap { @us = hist(arg2); }'
+// A probe is a single nop unless a tracer attaches. Without <sys/sdt.h>
+// (systemtap-sdt-dev), or with -DNO_USDT, they compile to nothing.
+#if defined(__has_include) && !defined(NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define TRACE0(name)             DTRACE_PROBE(tinyreaper, name)
+#define TRACE1(name, a)          DTRACE_PROBE1(tinyreaper, name, a)
+#define TRACE2(name, a, b)       DTRACE_PROBE2(tinyreaper, name, a, b)
+#define TRACE3(name, a, b, c)    DTRACE_PROBE3(tinyreaper, name, a, b, c)
+#else
+#define TRACE0(name)             do { } while (0)
+#define TRACE1(name, a)          do { (void)(a); } while (0)
+#define TRACE2(name, a, b)       do { (void)(a); (void)(b); } while (0)
+#define TRACE3(name, a, b, c)    do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
 
 #define VERSION "1.0.1"
 
 static int verbose = 0;
 
-// How much time we give children to terminate before terminating ourselves.
-static const int shutdown_timeout_seconds = 5;
+// How much time we give children to terminate after SIGTERM (--grace).
+static long grace_ms = 5000;
+
+// How much time we give children to die after SIGKILL (--kill); -1: no SIGKILL
+// stage. cgroup mode always escalates, by default with a 1s timeout.
+static long kill_timeout_ms = -1;
+static const long default_kill_timeout_ms = 1000;
+
+// Exit code if children remain after the shutdown sequence, like timeout(1).
+static const int shutdown_timeout_exit_code = 124;
+
+static pid_t command_pid = -1;
+static int command_running = 0;
+
+////////////////// logging        ////////////////////////////////////
+
+// Log output is formatted into a preallocated ring buffer and written out
+// once per event loop iteration with a single writev(). The fd is
+// non-blocking, so a slow stdout (e.g. a stalled log pipe) never blocks
+// reaping; if the buffer overflows, we drop messages and count them.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+struct output {
+	int fd;
+	int is_socket;  // write with send(MSG_DONTWAIT), we cannot reopen sockets
+	const char* dropped_format; // how to report drops; NULL: as log message
+	char* buf;      // OUTPUT_BUFFER_SIZE bytes; separate, so it ends up in .bss
+	size_t head;    // start of pending data
+	size_t len;     // amount of pending data
+	unsigned long dropped;
+	unsigned long dropped_reported;
+	int broken;     // a write failed for good (e.g. EPIPE); we drop everything
+};
+
+static char log_buffer[OUTPUT_BUFFER_SIZE];
+static struct output log_output = { STDOUT_FILENO, 0, NULL, log_buffer };
+
+// Until the ring is set up (and in the child after fork), we write directly.
+static int log_buffered = 0;
+
+// A small printf replacement: no stdio, no locale, no allocation, and safe to
+// use anywhere. It knows what we use: %d %i %u %x %c %s %f %%, with the flags
+// '-' and '0', field width, precision (%f, %s) and the l, ll and z modifiers.
+// Output is truncated to size - 1 and always terminated; returns its length.
+struct format_state {
+	char* buf;
+	size_t size;
+	size_t len;
+};
+
+static void format_char(struct format_state* st, char c) {
+	if (st->len + 1 < st->size) {
+		st->buf[st->len ++] = c;
+	}
+}
+
+static void format_field(struct format_state* st, const char* s, size_t n, int width, int left, char pad) {
+	int fill = width > (int)n ? width - (int)n : 0;
+	if (pad == '0' && !left && n > 0 && *s == '-') {
+		format_char(st, *s ++); // sign goes before zero padding
+		n --;
+	}
+	for (; !left && fill > 0; fill --) {
+		format_char(st, pad);
+	}
+	while (n -- > 0) {
+		format_char(st, *s ++);
+	}
+	for (; fill > 0; fill --) {
+		format_char(st, ' ');
+	}
+}
+
+// Writes v backwards into the end of buf; returns the start.
+static char* format_digits(char* end, unsigned long long v, unsigned base, int min_digits) {
+	char* p = end;
+	do {
+		*-- p = "0123456789abcdef"[v % base];
+		v /= base;
+		min_digits --;
+	} while (v != 0 || min_digits > 0);
+	return p;
+}
+
+static size_t format_v(char* buf, size_t size, const char* fmt, va_list ap) {
+	struct format_state st = { buf, size, 0 };
+	if (size == 0) {
+		return 0;
+	}
+	for (const char* f = fmt; *f != '\0'; f ++) {
+		if (*f != '%') {
+			format_char(&st, *f);
+			continue;
+		}
+		f ++;
+		int left = 0;
+		char pad = ' ';
+		for (; *f == '-' || *f == '0'; f ++) {
+			if (*f == '-') {
+				left = 1;
+			} else {
+				pad = '0';
+			}
+		}
+		int width = 0;
+		for (; *f >= '0' && *f <= '9'; f ++) {
+			width = width * 10 + (*f - '0');
+		}
+		int precision = -1;
+		if (*f == '.') {
+			precision = 0;
+			for (f ++; *f >= '0' && *f <= '9'; f ++) {
+				precision = precision * 10 + (*f - '0');
+			}
+		}
+		int longs = 0;
+		for (; *f == 'l' || *f == 'z'; f ++) {
+			longs += *f == 'z' ? 2 : 1;
+		}
+		char num[64];
+		char* end = num + sizeof(num);
+		char* p;
+		switch (*f) {
+		case 'd':
+		case 'i': {
+			const long long v = longs >= 2 ? va_arg(ap, long long) : longs == 1 ? va_arg(ap, long) : va_arg(ap, int);
+			p = format_digits(end, v < 0 ? -(unsigned long long)v : (unsigned long long)v, 10, 1);
+			if (v < 0) {
+				*-- p = '-';
+			}
+			format_field(&st, p, (size_t)(end - p), width, left, pad);
+			break;
+		}
+		case 'u':
+		case 'x': {
+			const unsigned long long v = longs >= 2 ? va_arg(ap, unsigned long long) :
+			                             longs == 1 ? va_arg(ap, unsigned long) : va_arg(ap, unsigned);
+			p = format_digits(end, v, *f == 'x' ? 16 : 10, 1);
+			format_field(&st, p, (size_t)(end - p), width, left, pad);
+			break;
+		}
+		case 'f': {
+			double v = va_arg(ap, double);
+			if (precision < 0) {
+				precision = 6;
+			}
+			if (precision > 9) {
+				precision = 9;
+			}
+			unsigned long long scale = 1;
+			for (int i = 0; i < precision; i ++) {
+				scale *= 10;
+			}
+			const int negative = v < 0;
+			const unsigned long long scaled = (unsigned long long)((negative ? -v : v) * (double)scale + 0.5);
+			p = format_digits(end, scaled % scale, 10, precision);
+			if (precision > 0) {
+				*-- p = '.';
+			}
+			p = format_digits(p, scaled / scale, 10, 1);
+			if (negative) {
+				*-- p = '-';
+			}
+			format_field(&st, p, (size_t)(end - p), width, left, pad);
+			break;
+		}
+		case 'c':
+			num[0] = (char)va_arg(ap, int);
+			format_field(&st, num, 1, width, left, ' ');
+			break;
+		case 's': {
+			const char* s = va_arg(ap, const char*);
+			if (s == NULL) {
+				s = "(null)";
+			}
+			size_t n = 0;
+			while (s[n] != '\0' && (precision < 0 || n < (size_t)precision)) {
+				n ++;
+			}
+			format_field(&st, s, n, width, left, ' ');
+			break;
+		}
+		case '%':
+			format_char(&st, '%');
+			break;
+		default: // unknown or end of string: print as is
+			format_char(&st, '%');
+			if (*f == '\0') {
+				f --;
+			} else {
+				format_char(&st, *f);
+			}
+			break;
+		}
+	}
+	buf[st.len] = '\0';
+	return st.len;
+}
+
+static size_t format(char* buf, size_t size, const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	size_t len = format_v(buf, size, fmt, ap);
+	va_end(ap);
+	return len;
+}
+
+// Appends a complete message, or drops it if it does not fit.
+static void output_append(struct output* out, const char* data, size_t len) {
+	if (len > OUTPUT_BUFFER_SIZE - out->len || out->broken) {
+		out->dropped ++;
+		return;
+	}
+	size_t tail = (out->head + out->len) % OUTPUT_BUFFER_SIZE;
+	size_t first = OUTPUT_BUFFER_SIZE - tail;
+	if (first > len) {
+		first = len;
+	}
+	memcpy(out->buf + tail, data, first);
+	memcpy(out->buf, data + first, len - first);
+	out->len += len;
+}
+
+// Writes as much pending data as the fd takes; returns 1 if data remains.
+static int output_flush(struct output* out) {
+	if (out->broken) {
+		return 0;
+	}
+	if (out->dropped != out->dropped_reported) {
+		char msg[96];
+		size_t len = format(msg, sizeof(msg),
+		                    out->dropped_format ? out->dropped_format : "tinyreaper: %lu messages dropped\n",
+		                    out->dropped - out->dropped_reported);
+		if (len <= OUTPUT_BUFFER_SIZE - out->len) {
+			out->dropped_reported = out->dropped;
+			output_append(out, msg, len);
+		}
+	}
+	while (out->len > 0) {
+		struct iovec iov[2];
+		int iovcnt = 1;
+		iov[0].iov_base = out->buf + out->head;
+		iov[0].iov_len = out->len;
+		if (out->head + out->len > OUTPUT_BUFFER_SIZE) {
+			iov[0].iov_len = OUTPUT_BUFFER_SIZE - out->head;
+			iov[1].iov_base = out->buf;
+			iov[1].iov_len = out->len - iov[0].iov_len;
+			iovcnt = 2;
+		}
+		ssize_t bytes;
+		if (out->is_socket) {
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iovcnt;
+			bytes = sendmsg(out->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		} else {
+			bytes = writev(out->fd, iov, iovcnt);
+		}
+		if (bytes == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				// Broken fd, e.g. the reader of a pipe is gone (EPIPE; we
+				// ignore SIGPIPE): nothing we can do, count what is lost.
+				for (size_t i = 0; i < out->len; i ++) {
+					out->dropped += out->buf[(out->head + i) % OUTPUT_BUFFER_SIZE] == '\n';
+				}
+				out->len = 0;
+				out->broken = 1;
+			}
+			break;
+		}
+		out->head = (out->head + (size_t)bytes) % OUTPUT_BUFFER_SIZE;
+		out->len -= (size_t)bytes;
+	}
+	return out->len > 0;
+}
+
+// Called on exit: give pending output a last chance, but do not hang.
+static void output_drain(struct output* out) {
+	const int timeout_ms = 3000;
+	for (int waited = 0; waited < timeout_ms && output_flush(out); waited += 100) {
+		struct pollfd pfd = { out->fd, POLLOUT, 0 };
+		poll(&pfd, 1, 100);
+	}
+}
+
+// Sets up out to write to fd without blocking. Pipes and ttys are reopened via
+// /proc/self/fd, since setting O_NONBLOCK on the inherited file description
+// would also affect the command writing to it.
+static void output_open(struct output* out, int fd) {
+	struct stat st;
+	out->fd = fd;
+	if (fstat(fd, &st) == -1) {
+		return;
+	}
+	if (S_ISSOCK(st.st_mode)) {
+		out->is_socket = 1;
+	} else if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)) {
+		char path[64];
+		format(path, sizeof(path), "/proc/self/fd/%d", fd);
+		int nfd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
+		if (nfd != -1) {
+			out->fd = nfd;
+		}
+	}
+	// Regular files never block.
+}
+
+static void write_log(const char* data, size_t len) {
+	if (log_buffered) {
+		output_append(&log_output, data, len);
+	} else {
+		while (write(log_output.fd, data, len) == -1 && errno == EINTR);
+	}
+}
+
+static void drain_log() {
+	output_drain(&log_output);
+}
+
+static void initialize_logging() {
+	// A reader of our stdout that went away must not kill us; writes fail
+	// with EPIPE instead. The child restores the default before exec.
+	signal(SIGPIPE, SIG_IGN);
+	output_open(&log_output, STDOUT_FILENO);
+	log_buffered = 1;
+	atexit(drain_log);
+}
+
+#define LOG(msg)  					write_log("tinyreaper: " msg "\n", sizeof("tinyreaper: " msg "\n") - 1)
+
+static void LOGf(const char* fmt, ...) {
+	char line[512];
+	size_t len = format(line, sizeof(line), "tinyreaper: ");
+	va_list ap;
+	va_start(ap, fmt);
+	len += format_v(line + len, sizeof(line) - len - 1, fmt, ap);
+	va_end(ap);
+	line[len ++] = '\n';
+	write_log(line, len);
+}
+
+#define VERBOSEf(fmt, ...) 	if (verbose) { LOGf(fmt, __VA_ARGS__); }
+#define VERBOSE(msg) 		if (verbose) { LOG(msg); }
+
+// Usage goes straight to stdout, before the log is set up.
+static void print(const char* s) {
+	while (write(STDOUT_FILENO, s, strlen(s)) == -1 && errno == EINTR);
+}
+
+static void print_usage() {
+	print("tinyreaper [Options] <command> [<command arguments>]\n");
+	print("tinyreaper [Options] -- <command> [<arguments>] [-- <command> [<arguments>] ...]\n");
+	print("\n");
+	print("Registers itself as sub reaper for child processes, then starts <command>.\n");
+	print("\n");
+	print("Options:\n");
+    print("`-v`: verbose mode\n");
+	print("`-V`: version\n");
+	print("`-h`: this help\n");
+	print("`--pidfd`: track and signal command and adopted orphans via pidfds\n");
+	print("`--cgroup`: run command in a child cgroup (v2), terminate via cgroup\n");
+	print("`--on-exit=shutdown|ignore`: when one of several commands exits (default: shutdown)\n");
+	print("`--restart=no|on-failure|always`: restart commands which exited (default: no)\n");
+	print("`--max-restarts=<n>`: give up after <n> restarts (default: unlimited)\n");
+	print("`--restart-delay=<time>[,<max>]`: initial and maximum restart delay (default: 100ms,10s)\n");
+	print("`--restart-orphans=keep|terminate`: on restart, SIGTERM what the command left behind (default: keep)\n");
+	print("`--grace=<time>`: time children get to exit after SIGTERM (default: 5s)\n");
+	print("`--kill[=<time>]`: then SIGKILL them and wait <time> (default: 1s)\n");
+	print("`--stagger=<n>[,<time>]`: SIGTERM <n> processes every <time> (default: 100ms)\n");
+	print("`--stagger-order=leaves|parents`: order of staggered SIGTERM (default: leaves)\n");
+	print("`--log-summary[=<time>]`: log exits as one summary line per <time> (default: 1s)\n");
+	print("`--log-rate=<n>`: in summary mode, log at most <n> failed exits per interval (default: 10)\n");
+	print("`--metrics=<address>`: serve Prometheus metrics at unix:<path> or [<ip>]:<port>\n");
+	print("`--probe=<address>`: serve /healthz and /readyz at unix:<path> or [<ip>]:<port>\n");
+	print("`--ready-signal=<sig>`: the command signals readiness by sending <sig> to its parent\n");
+	print("`--notify`: provide a NOTIFY_SOCKET to the command (READY=1, STATUS=, WATCHDOG=1)\n");
+	print("`--notify-socket=<path>`: use <path> (or @<name>: abstract) as notify socket\n");
+	print("`--watchdog=<time>`: terminate if the command does not send WATCHDOG=1 within <time>\n");
+	print("`--ready-file=<path>`: create <path> once the command is ready\n");
+	print("`--wait-ready`: return once the command is ready, keep running in the background\n");
+	print("`--standby[=barrier|exec[:<sig>]]`: with --restart, keep a standby instance ready for fast failover\n");
+	print("`--reaper-cpus=<list>`: run tinyreaper on these CPUs, e.g. 0-1,4\n");
+	print("`--reaper-sched=<policy>`: tinyreaper's policy: other|batch|idle|fifo:<prio>|rr:<prio>\n");
+	print("`--reaper-nice=<n>`: tinyreaper's nice value\n");
+	print("`--cpus=<list>`: run the command on these CPUs\n");
+	print("`--sched=<policy>`: the command's scheduling policy, see --reaper-sched\n");
+	print("`--nice=<n>`: the command's nice value\n");
+	print("`--numa=<policy>`: the command's memory policy: local|preferred:<node>|bind:<nodes>|interleave:<nodes>\n");
+	print("`--stats-file=<path>`: publish statistics in a shared memory page at <path>\n");
+	print("`--rusage[=<n>]`: account resource usage per comm, log the top <n> (default: 10) at exit\n");
+	print("`--orphan-profile[=<time>]`: profile orphan lifetimes per spawner, scanning every <time> (default: 1s)\n");
+	print("`--relay[=<size>]`: relay the command's stdout/stderr through pipes of <size> (default: 1M)\n");
+	print("`--relay-tags`: relay, and prefix each line with [stdout] or [stderr]\n");
+	print("`--events-fd=<n>`: write JSON lines for spawns, adoptions, exits, signals and shutdown to fd <n>\n");
+	print("`--events-file=<path>`: same, appended to <path>\n");
+	print("`--pids-max=<n>`: limit the command's processes (pids.max with --cgroup, else RLIMIT_NPROC)\n");
+	print("`--pid-pressure=<n>[,<rate>]`: overload: more than <n> descendants, or <rate> exits per second\n");
+	print("`--pid-pressure-time=<time>`: act once overload lasts <time> (default: 3s)\n");
+	print("`--pid-pressure-action=log|stop|shutdown`: log, SIGSTOP the biggest spawner, or shut down (default: log)\n");
+	print("`--forward=<sig>[:<newsig>][@command|tree|cgroup]`: forward <sig> (as <newsig>) instead of handling it (default: HUP, WINCH, USR2 to the command)\n");
+	print("`--zombie-check=<n>[,<time>]`: check every <time> (default: 1s) for more than <n> unreaped zombies\n");
+	print("`--report[=json]`: log reaper statistics at exit (also logged on SIGUSR1), or a JSON summary\n");
+}
+
+static void LOG_process_state(pid_t pid, int status) {
+	char line[64];
+	size_t len = 0;
+	if (pid > 0) {
+		if (WIFEXITED(status)) {
+			len = format(line, sizeof(line), "child %d exited with %d\n", (int)pid, WEXITSTATUS(status));
+		} else if (WIFSIGNALED(status)) {
+			len = format(line, sizeof(line), "child %d terminated with %d\n", (int)pid, WTERMSIG(status));
+		}
+	}
+	write_log(line, len);
+}
+
+
+////////////////// event loop ////////////////////////////////////
+
+// Everything tinyreaper reacts to - signals, timers - is a file descriptor
+// multiplexed via one epoll instance. Each source carries its own handler,
+// which is expected to drain all events pending on its fd in one go.
+struct event_source;
+typedef void (*event_handler_t)(struct event_source* src, uint32_t events);
+
+struct event_source {
+	int fd;
+	event_handler_t handler;
+};
+
+static int epoll_fd = -1;
+
+// see stats page
+static void update_stats_page();
+static void record_recent_exit(pid_t pid, int status, uint64_t reaped_ns);
+// see readiness
+static void fail_readiness();
+// see events
+static int flush_events();
+// see restart
+static void cancel_restarts();
+// see standby
+static int standby_exited(pid_t pid);
+static int is_standby(pid_t pid);
+static void cancel_standby();
+// see pid pressure
+static void resume_stopped_spawners();
+// see output relay
+static void close_relay_write_ends();
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Our best estimate of when the events handled in this iteration happened:
+// the wakeup time, or, if they were already pending when we called
+// epoll_wait, the start of the previous iteration.
+static uint64_t events_observed_ns = 0;
+
+// Set by handlers to leave the event loop.
+static int event_loop_done = 0;
+
+static void initialize_event_loop() {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		LOGf("Failed to create epoll instance - errno: %d (%s)", errno, strerror(errno));
+		exit(-1);
+	}
+}
+
+static int add_event_source(struct event_source* src, uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) == -1) {
+		LOGf("Failed to add fd %d to epoll - errno: %d (%s)", src->fd, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void run_event_loop() {
+	struct epoll_event events[16];
+	uint64_t wakeup_ns = now_ns();
+	while (!event_loop_done) {
+		update_stats_page();
+		// One write per iteration; if stdout is backed up, retry soon.
+		const int pending = (log_buffered && output_flush(&log_output)) | flush_events();
+		const uint64_t wait_ns = now_ns();
+		int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), pending ? 20 : -1);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOGf("epoll_wait failed - errno: %d (%s)", errno, strerror(errno));
+			exit(-1);
+		}
+		const uint64_t previous_wakeup_ns = wakeup_ns;
+		wakeup_ns = now_ns();
+		events_observed_ns = (wakeup_ns - wait_ns < 50000) ? previous_wakeup_ns : wakeup_ns;
+		for (int i = 0; i < n && !event_loop_done; i ++) {
+			struct event_source* src = (struct event_source*) events[i].data.ptr;
+			src->handler(src, events[i].events);
+		}
+	}
+}
+
+////////////////// events ////////////////////////////////////
+
+// --events-fd=<n>, --events-file=<path>: machine readable JSON lines, one per
+// spawn, adoption, exit, signal and shutdown phase, e.g.
+//   {"ts":123456789,"event":"exit","pid":42,"comm":"sh","code":0,...}
+// ts is CLOCK_MONOTONIC in nanoseconds. Events go through their own output
+// ring, flushed with the log, so they never block reaping either.
+static char events_buffer[OUTPUT_BUFFER_SIZE];
+static struct output events_output = { -1, 0, "{\"event\":\"dropped\",\"count\":%lu}\n", events_buffer };
+
+// Once the reader is gone (EPIPE) we stop producing events, and peeking at
+// exiting children for them.
+static int events_enabled() {
+	return events_output.fd != -1 && !events_output.broken;
+}
+
+static int flush_events() {
+	return events_enabled() && output_flush(&events_output);
+}
+
+static void drain_events() {
+	output_drain(&events_output);
+}
+
+static void initialize_events(int fd) {
+	output_open(&events_output, fd);
+	atexit(drain_events);
+}
+
+// Writes s as a JSON string, including the quotes.
+static size_t json_string(char* buf, size_t size, const char* s) {
+	size_t len = 0;
+	if (size < 3) {
+		return 0;
+	}
+	buf[len ++] = '"';
+	for (; *s && len + 7 < size; s ++) { // room for an escape and the closing quote
+		const unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			buf[len ++] = '\\';
+			buf[len ++] = (char)c;
+		} else if (c < 0x20) {
+			len += format(buf + len, size - len, "\\u%04x", c);
+		} else {
+			buf[len ++] = (char)c;
+		}
+	}
+	buf[len ++] = '"';
+	buf[len] = '\0';
+	return len;
+}
+
+// Emits {"ts":<now>,"event":"<event>",<fields>}; fields are preformatted JSON.
+static void emit_event(const char* event, const char* fmt, ...) {
+	if (!events_enabled()) {
+		return;
+	}
+	char line[512];
+	size_t len = format(line, sizeof(line), "{\"ts\":%llu,\"event\":\"%s\"",
+	                    (unsigned long long)now_ns(), event);
+	if (fmt != NULL) {
+		line[len ++] = ',';
+		va_list ap;
+		va_start(ap, fmt);
+		len += format_v(line + len, sizeof(line) - len, fmt, ap);
+		va_end(ap);
+	}
+	if (len > sizeof(line) - 3) {
+		len = sizeof(line) - 3; // truncated; keep the line parseable at least as a line
+	}
+	line[len ++] = '}';
+	line[len ++] = '\n';
+	output_append(&events_output, line, len);
+}
+
+static void emit_spawn_event(pid_t pid, const char* path) {
+	if (events_enabled()) {
+		char quoted[PATH_MAX + 16];
+		json_string(quoted, sizeof(quoted), path);
+		emit_event("spawn", "\"pid\":%d,\"path\":%s", (int)pid, quoted);
+	}
+}
+
+static void emit_adopt_event(pid_t pid, const char* comm) {
+	if (!events_enabled()) {
+		return;
+	}
+	if (comm == NULL) {
+		emit_event("adopt", "\"pid\":%d", (int)pid);
+		return;
+	}
+	char quoted[80];
+	json_string(quoted, sizeof(quoted), comm);
+	emit_event("adopt", "\"pid\":%d,\"comm\":%s", (int)pid, quoted);
+}
+
+// comm is "" and ru NULL unless we peeked at the zombie (see reaping).
+static void emit_exit_event(pid_t pid, const char* comm, int status, int is_command,
+                            const struct rusage* ru) {
+	if (!events_enabled()) {
+		return;
+	}
+	char quoted[80];
+	json_string(quoted, sizeof(quoted), comm);
+	char result[32];
+	if (WIFSIGNALED(status)) {
+		format(result, sizeof(result), "\"signal\":%d", WTERMSIG(status));
+	} else {
+		format(result, sizeof(result), "\"code\":%d", WEXITSTATUS(status));
+	}
+	if (ru == NULL) {
+		emit_event("exit", "\"pid\":%d,\"comm\":%s,%s,\"command\":%s",
+		           (int)pid, quoted, result, is_command ? "true" : "false");
+		return;
+	}
+	emit_event("exit", "\"pid\":%d,\"comm\":%s,%s,\"command\":%s,"
+	           "\"utime_us\":%llu,\"stime_us\":%llu,\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld",
+	           (int)pid, quoted, result, is_command ? "true" : "false",
+	           (unsigned long long)ru->ru_utime.tv_sec * 1000000ull + (unsigned long long)ru->ru_utime.tv_usec,
+	           (unsigned long long)ru->ru_stime.tv_sec * 1000000ull + (unsigned long long)ru->ru_stime.tv_usec,
+	           ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt);
+}
+
+static void emit_signal_event(int sig, pid_t sender) {
+	emit_event("signal", "\"signal\":%d,\"sender\":%d", sig, (int)sender);
+}
+
+static void emit_phase_event(const char* phase, int sig) {
+	emit_event("shutdown", "\"phase\":\"%s\",\"signal\":%d", phase, sig);
+}
+
+////////////////// timers ////////////////////////////////////
+
+static int create_timer() {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		LOGf("Failed to create timer - errno: %d (%s)", errno, strerror(errno));
+		exit(-1);
+	}
+	return fd;
+}
+
+// Arms a one-shot timer; 0 disarms it.
+static void arm_timer(int fd, long ms) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+		LOGf("Failed to arm timer - errno: %d (%s)", errno, strerror(errno));
+	}
+}
+
+// Arms a one-shot timer for a deadline; unlike arm_timer(), 0 fires right away.
+static void arm_deadline(int fd, long ms) {
+	if (ms > 0) {
+		arm_timer(fd, ms);
+		return;
+	}
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = 1;
+	if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+		LOGf("Failed to arm timer - errno: %d (%s)", errno, strerror(errno));
+	}
+}
+
+// Arms a timer firing every ms milliseconds.
+static void arm_periodic_timer(int fd, long ms) {
+	struct itimerspec its;
+	its.it_value.tv_sec = its.it_interval.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = (ms % 1000) * 1000000L;
+	if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+		LOGf("Failed to arm timer - errno: %d (%s)", errno, strerror(errno));
+	}
+}
+
+// Consumes the expiration count of a timer; returns 0 if it did not fire.
+static uint64_t read_timer(int fd) {
+	uint64_t expirations = 0;
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		return 0;
+	}
+	return expirations;
+}
+
+static void reap_children();
+
+////////////////// file helpers ////////////////////////////////////
+
+// Reads up to size-1 bytes of a (small, pseudo-) file and zero terminates
+// them. Returns the number of bytes read or -1.
+static ssize_t read_file(const char* path, char* buf, size_t size) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	size_t len = 0;
+	while (len < size - 1) {
+		ssize_t bytes = read(fd, buf + len, size - 1 - len);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			break;
+		}
+		len += (size_t)bytes;
+	}
+	close(fd);
+	buf[len] = '\0';
+	return (ssize_t)len;
+}
+
+static int write_file(const char* path, const char* value) {
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	const size_t len = strlen(value);
+	ssize_t bytes = write(fd, value, len);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return bytes == (ssize_t)len ? 0 : -1;
+}
+
+////////////////// cgroup mode ////////////////////////////////////
+
+// cgroup mode (--cgroup): the command runs in a child cgroup of our own. All its
+// descendants stay in there, even if they setsid(), so we can signal and kill
+// the whole subtree and learn from cgroup.events when it is empty.
+static int use_cgroup = 0;
+static char cgroup_dir[PATH_MAX];
+
+static void handle_cgroup_events(struct event_source* src, uint32_t events);
+static struct event_source cgroup_events = { -1, handle_cgroup_events };
+
+// Finds the mount point of the cgroup v2 hierarchy.
+static int find_cgroup2_mount(char* mount, size_t size) {
+	static char mountinfo[64 * 1024];
+	if (read_file("/proc/self/mountinfo", mountinfo, sizeof(mountinfo)) == -1) {
+		return -1;
+	}
+	// Lines look like: "42 32 0:38 / /sys/fs/cgroup rw,relatime - cgroup2 cgroup2 rw"
+	for (char* line = mountinfo; line && *line; ) {
+		char* next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		}
+		const char* sep = strstr(line, " - cgroup2 ");
+		if (sep) {
+			char* field = line;
+			for (int i = 0; i < 4 && field; i ++) {
+				field = strchr(field, ' ');
+				if (field) {
+					field ++;
+				}
+			}
+			char* end = field ? strchr(field, ' ') : NULL;
+			if (end && (size_t)(end - field) < size) {
+				memcpy(mount, field, (size_t)(end - field));
+				mount[end - field] = '\0';
+				return 0;
+			}
+		}
+		line = next;
+	}
+	return -1;
+}
+
+// Finds our own cgroup (relative to the hierarchy root).
+static int find_own_cgroup(char* path, size_t size) {
+	char buf[4096];
+	if (read_file("/proc/self/cgroup", buf, sizeof(buf)) == -1) {
+		return -1;
+	}
+	// The cgroup v2 entry looks like "0::/some/path"
+	const char* p = strncmp(buf, "0::", 3) == 0 ? buf : strstr(buf, "\n0::");
+	if (p == NULL) {
+		return -1;
+	}
+	p += (*p == '\n') ? 4 : 3;
+	size_t len = strcspn(p, "\n");
+	if (len >= size) {
+		return -1;
+	}
+	memcpy(path, p, len);
+	path[len] = '\0';
+	return 0;
+}
+
+static int cgroup_file(char* path, size_t size, const char* name) {
+	return format(path, size, "%s/%s", cgroup_dir, name) < size - 1 ? 0 : -1;
+}
+
+static int initialize_cgroup() {
+	char mount[PATH_MAX];
+	char own[PATH_MAX];
+	if (find_cgroup2_mount(mount, sizeof(mount)) == -1 || find_own_cgroup(own, sizeof(own)) == -1) {
+		LOG("Failed to locate cgroup v2 hierarchy.");
+		return -1;
+	}
+	if (format(cgroup_dir, sizeof(cgroup_dir), "%s%s%stinyreaper-%d",
+	           mount, own, own[strlen(own) - 1] == '/' ? "" : "/", (int)getpid()) >= sizeof(cgroup_dir) - 1) {
+		LOG("cgroup path too long.");
+		return -1;
+	}
+	if (mkdir(cgroup_dir, 0755) == -1) {
+		LOGf("Failed to create cgroup %s - errno: %d (%s)", cgroup_dir, errno, strerror(errno));
+		return -1;
+	}
+	char path[PATH_MAX];
+	cgroup_file(path, sizeof(path), "cgroup.events");
+	cgroup_events.fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (cgroup_events.fd == -1) {
+		LOGf("Failed to open %s - errno: %d (%s)", path, errno, strerror(errno));
+		rmdir(cgroup_dir);
+		return -1;
+	}
+	// cgroup.events signals modifications as EPOLLPRI
+	add_event_source(&cgroup_events, EPOLLPRI);
+	VERBOSEf("command cgroup: %s", cgroup_dir);
+	return 0;
+}
+
+// Called in the (vforked) child before exec, with the path of cgroup.procs
+// prepared by the parent; everything it spawns will inherit the cgroup.
+static int join_command_cgroup(const char* procs_path) {
+	return write_file(procs_path, "0");
+}
+
+// Returns 1 if the cgroup still contains processes, 0 if not, -1 on error.
+static int cgroup_populated() {
+	char buf[256];
+	ssize_t len = pread(cgroup_events.fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		return -1;
+	}
+	buf[len] = '\0';
+	const char* p = strstr(buf, "populated ");
+	return p ? (p[10] == '1') : -1;
+}
+
+static void handle_cgroup_events(struct event_source* src, uint32_t events) {
+	if (cgroup_populated() == 0) {
+		// Everything in the subtree exited; collect the zombies.
+		VERBOSE("command cgroup is empty.");
+		reap_children();
+	}
+}
+
+// Sends sig to every member of the command cgroup, except those in process
+// group skip_pgrp (if not 0).
+static void signal_cgroup(int sig, pid_t skip_pgrp) {
+	char path[PATH_MAX];
+	static char procs[64 * 1024];
+	cgroup_file(path, sizeof(path), "cgroup.procs");
+	if (read_file(path, procs, sizeof(procs)) == -1) {
+		return;
+	}
+	for (char* p = procs; *p; ) {
+		char* end;
+		long pid = strtol(p, &end, 10);
+		if (end == p) {
+			break;
+		}
+		if (pid > 0 && pid != getpid() && (skip_pgrp == 0 || getpgid((pid_t)pid) != skip_pgrp)) {
+			kill((pid_t)pid, sig);
+		}
+		p = end;
+	}
+}
+
+// Kills the whole subtree at once (Linux 5.14+), falls back to SIGKILL per member.
+static void kill_cgroup() {
+	char path[PATH_MAX];
+	cgroup_file(path, sizeof(path), "cgroup.kill");
+	if (write_file(path, "1") == -1) {
+		VERBOSEf("Failed to write cgroup.kill - errno: %d (%s)", errno, strerror(errno));
+		signal_cgroup(SIGKILL, 0);
+	}
+}
+
+static void remove_cgroup() {
+	if (cgroup_dir[0] != '\0' && rmdir(cgroup_dir) == -1) {
+		VERBOSEf("Failed to remove cgroup %s - errno: %d (%s)", cgroup_dir, errno, strerror(errno));
+	}
+}
+
+////////////////// Child handling ////////////////////////////////////
+
+// What getdents64(2) returns; we use it instead of readdir(), which allocates.
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// Appends the children of all threads of pid to out; returns the new count.
+static int read_children(pid_t pid, pid_t* out, int max) {
+	static char buf[64 * 1024];
+	static char entries[4096];
+	char path[64];
+	int n = 0;
+	format(path, sizeof(path), "/proc/%d/task", (int)pid);
+	const int dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir == -1) {
+		return 0;
+	}
+	long got;
+	while (n < max && (got = syscall(SYS_getdents64, dir, entries, sizeof(entries))) > 0) {
+		for (long off = 0; off < got && n < max; ) {
+			const struct linux_dirent64* entry = (const struct linux_dirent64*)(entries + off);
+			off += entry->d_reclen;
+			if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+				continue;
+			}
+			format(path, sizeof(path), "/proc/%d/task/%s/children", (int)pid, entry->d_name);
+			if (read_file(path, buf, sizeof(buf)) <= 0) {
+				continue;
+			}
+			for (char* p = buf; n < max; ) {
+				char* end;
+				long child = strtol(p, &end, 10);
+				if (end == p) {
+					break;
+				}
+				out[n ++] = (pid_t)child;
+				p = end;
+			}
+		}
+	}
+	close(dir);
+	return n;
+}
+
+
+// pidfd mode (--pidfd): the command and adopted orphans are tracked via pidfds,
+// which are watched in the event loop and used for targeted signalling.
+static int use_pidfd = 0;
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+
+static int sys_pidfd_open(pid_t pid) {
+	return (int)syscall(__NR_pidfd_open, pid, 0);
+}
+
+static int sys_pidfd_send_signal(int pidfd, int sig) {
+	return (int)syscall(__NR_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+static void handle_pidfd(struct event_source* src, uint32_t events) {
+	// A tracked process exited. We do not care which one; reap all.
+	reap_children();
+}
+
+// The commands we run: usually one, several in supervisor mode
+// (-- <cmdA> ... -- <cmdB> ...). The first one is the main command; readiness
+// and liveness refer to it.
+#define MAX_COMMANDS 16
+
+struct command {
+	char** argv;
+	pid_t pid;
+	int running;
+	int status;     // wait(2) style, once reaped
+	int stopped;    // still running when another command's exit shut us down
+	struct event_source pidfd;
+	// see restart
+	uint64_t started_ns;
+	int restarts;
+	int backoff;    // exponent of the next restart delay
+	struct event_source restart_timer;
+};
+
+static struct command commands[MAX_COMMANDS];
+static int num_commands = 0;
+
+#define command_pidfd (commands[0].pidfd)
+
+static struct command* find_command(pid_t pid) {
+	for (int i = 0; i < num_commands; i ++) {
+		if (commands[i].pid == pid) {
+			return &commands[i];
+		}
+	}
+	return NULL;
+}
+
+// Shared by all orphan pidfds; epoll only needs to tell us that one is readable.
+static struct event_source orphan_pidfd_source = { -1, handle_pidfd };
+
+// Open addressing table of pidfds for adopted orphans, keyed by pid.
+#define MAX_ORPHAN_PIDFDS 1024
+
+static struct {
+	pid_t pid; // 0: free
+	int fd;
+} orphan_pidfds[MAX_ORPHAN_PIDFDS];
+
+static int num_orphan_pidfds = 0;
+
+// How many orphans we track at most; see limit_orphan_pidfds().
+static int max_orphan_pidfds = MAX_ORPHAN_PIDFDS - 1; // keep one slot free so lookups terminate
+
+// Fds we keep for everything else (epoll, signalfd, timers, http, /proc reads).
+#define RESERVED_FDS 64
+
+// Each tracked orphan costs an fd; do not let them exhaust RLIMIT_NOFILE.
+// Orphans beyond that are found by scanning our children and signalled by pid.
+static void limit_orphan_pidfds() {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+	    rl.rlim_cur < (rlim_t)max_orphan_pidfds + RESERVED_FDS) {
+		max_orphan_pidfds = rl.rlim_cur > RESERVED_FDS ? (int)(rl.rlim_cur - RESERVED_FDS) : 0;
+		VERBOSEf("tracking at most %d orphans via pidfds (RLIMIT_NOFILE %lu)", max_orphan_pidfds, (unsigned long)rl.rlim_cur);
+	}
+}
+
+static unsigned pid_hash(pid_t pid, unsigned size) {
+	return ((unsigned)pid * 2654435761u) % size;
+}
+
+static int find_orphan_pidfd_slot(pid_t pid) {
+	unsigned idx = pid_hash(pid, MAX_ORPHAN_PIDFDS);
+	for (int probe = 0; probe < MAX_ORPHAN_PIDFDS; probe ++) {
+		if (orphan_pidfds[idx].pid == pid || orphan_pidfds[idx].pid == 0) {
+			return (int)idx;
+		}
+		idx = (idx + 1) % MAX_ORPHAN_PIDFDS;
+	}
+	return -1;
+}
+
+// Start tracking pid via pidfd; returns the pidfd if it is new, -1 otherwise.
+static int track_orphan(pid_t pid) {
+	static int table_full_logged = 0;
+	if (num_orphan_pidfds >= max_orphan_pidfds) {
+		if (!table_full_logged) {
+			LOGf("Note: Tracking %d orphans via pidfds, signalling further ones by pid.", num_orphan_pidfds);
+			table_full_logged = 1;
+		}
+		return -1;
+	}
+	int slot = find_orphan_pidfd_slot(pid);
+	if (slot == -1 || orphan_pidfds[slot].pid == pid) {
+		return -1;
+	}
+	int fd = sys_pidfd_open(pid);
+	if (fd == -1) {
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &orphan_pidfd_source;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	orphan_pidfds[slot].pid = pid;
+	orphan_pidfds[slot].fd = fd;
+	num_orphan_pidfds ++;
+	TRACE1(adopt, pid);
+	emit_adopt_event(pid, NULL);
+	return fd;
+}
+
+static int is_tracked_orphan(pid_t pid) {
+	const int slot = find_orphan_pidfd_slot(pid);
+	return slot != -1 && orphan_pidfds[slot].pid == pid;
+}
+
+// Called when pid has been reaped.
+static void untrack_orphan(pid_t pid) {
+	if (num_orphan_pidfds == 0) {
+		return;
+	}
+	int slot = find_orphan_pidfd_slot(pid);
+	if (slot == -1 || orphan_pidfds[slot].pid != pid) {
+		return;
+	}
+	close(orphan_pidfds[slot].fd); // also removes it from epoll
+	orphan_pidfds[slot].pid = 0;
+	num_orphan_pidfds --;
+	// Backward shift deletion: move up entries whose probe chain crossed the hole.
+	unsigned hole = (unsigned)slot;
+	unsigned idx = (hole + 1) % MAX_ORPHAN_PIDFDS;
+	while (orphan_pidfds[idx].pid != 0) {
+		unsigned home = pid_hash(orphan_pidfds[idx].pid, MAX_ORPHAN_PIDFDS);
+		if ((idx > hole && (home <= hole || home > idx)) ||
+		    (idx < hole && (home <= hole && home > idx))) {
+			orphan_pidfds[hole] = orphan_pidfds[idx];
+			orphan_pidfds[idx].pid = 0;
+			hole = idx;
+		}
+		idx = (idx + 1) % MAX_ORPHAN_PIDFDS;
+	}
+}
+
+////////////////// process tree ////////////////////////////////////
+
+// A snapshot of our descendants: pid -> {ppid, comm, start time}. It is built
+// by walking /proc/<pid>/task/*/children down from ourselves, never by scanning
+// all of /proc, and refreshed incrementally on demand: /proc/<pid>/stat is only
+// read for processes we have not seen before (or that got a new parent).
+#define MAX_TRACKED_PROCESSES 16384 // power of two
+
+struct process_info {
+	pid_t pid; // 0: free slot
+	pid_t ppid;
+	unsigned long long start_time; // clock ticks since boot
+	char comm[16];
+	unsigned generation; // last refresh which saw this process
+	// see orphan profile
+	uint64_t adopted_ns; // 0: not adopted (yet)
+	int spawner;         // profile slot of the process' original parent + 1
+};
+
+static struct process_info process_table[MAX_TRACKED_PROCESSES];
+static int num_tracked_processes = 0;
+static unsigned tree_generation = 0;
+
+// Descendants in the order of the last refresh: parents before their children.
+static pid_t tree_order[MAX_TRACKED_PROCESSES];
+static int tree_order_count = 0;
+
+static unsigned process_slot(pid_t pid) {
+	return pid_hash(pid, MAX_TRACKED_PROCESSES);
+}
+
+static struct process_info* find_process(pid_t pid) {
+	for (unsigned idx = process_slot(pid); process_table[idx].pid != 0;
+	     idx = (idx + 1) % MAX_TRACKED_PROCESSES) {
+		if (process_table[idx].pid == pid) {
+			return process_table + idx;
+		}
+	}
+	return NULL;
+}
+
+static struct process_info* add_process(pid_t pid) {
+	if (num_tracked_processes >= MAX_TRACKED_PROCESSES - 1) {
+		return NULL; // keep one slot free so lookups terminate
+	}
+	unsigned idx = process_slot(pid);
+	while (process_table[idx].pid != 0 && process_table[idx].pid != pid) {
+		idx = (idx + 1) % MAX_TRACKED_PROCESSES;
+	}
+	if (process_table[idx].pid == 0) {
+		num_tracked_processes ++;
+	}
+	memset(process_table + idx, 0, sizeof(process_table[idx]));
+	process_table[idx].pid = pid;
+	return process_table + idx;
+}
+
+static void remove_process(pid_t pid) {
+	struct process_info* p = find_process(pid);
+	if (p == NULL) {
+		return;
+	}
+	p->pid = 0;
+	num_tracked_processes --;
+	// Backward shift deletion, see untrack_orphan().
+	unsigned hole = (unsigned)(p - process_table);
+	unsigned idx = (hole + 1) % MAX_TRACKED_PROCESSES;
+	while (process_table[idx].pid != 0) {
+		unsigned home = process_slot(process_table[idx].pid);
+		if ((idx > hole && (home <= hole || home > idx)) ||
+		    (idx < hole && (home <= hole && home > idx))) {
+			process_table[hole] = process_table[idx];
+			process_table[idx].pid = 0;
+			hole = idx;
+		}
+		idx = (idx + 1) % MAX_TRACKED_PROCESSES;
+	}
+}
+
+// Reads ppid, comm and start time from /proc/<pid>/stat.
+static int read_process_stat(pid_t pid, struct process_info* info) {
+	char path[64];
+	char buf[1024];
+	format(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0) {
+		return -1;
+	}
+	// "<pid> (<comm>) <state> <ppid> ..."; comm may contain anything, even ')'.
+	char* open = strchr(buf, '(');
+	char* close = strrchr(buf, ')');
+	if (open == NULL || close == NULL || close < open) {
+		return -1;
+	}
+	size_t len = (size_t)(close - open - 1);
+	if (len >= sizeof(info->comm)) {
+		len = sizeof(info->comm) - 1;
+	}
+	memcpy(info->comm, open + 1, len);
+	info->comm[len] = '\0';
+	// Fields after comm start with state (3); ppid is 4, starttime is 22.
+	char* p = close + 2;
+	for (int field = 3; field < 22 && p; field ++) {
+		if (field == 4) {
+			info->ppid = (pid_t)strtol(p, NULL, 10);
+		}
+		p = strchr(p, ' ');
+		if (p) {
+			p ++;
+		}
+	}
+	info->start_time = p ? strtoull(p, NULL, 10) : 0;
+	return 0;
+}
+
+// see orphan profile
+static int orphan_profile_ms;
+static void profile_process(struct process_info* p, const struct process_info* previous);
+
+// Walks the tree below us, updates the table and tree_order. Processes which
+// vanished since the last refresh are dropped. Returns the number of new ones.
+static int refresh_process_tree() {
+	static pid_t children[4096];
+	tree_generation ++;
+	tree_order_count = 0;
+	int added = 0;
+	pid_t parent = getpid();
+	for (int next = 0; ; ) {
+		const int n = read_children(parent, children, sizeof(children) / sizeof(children[0]));
+		for (int i = 0; i < n && tree_order_count < MAX_TRACKED_PROCESSES; i ++) {
+			struct process_info* p = find_process(children[i]);
+			if (p == NULL || p->ppid != parent) {
+				// New, re-parented, or the pid got reused: (re)read stat.
+				struct process_info info;
+				if (read_process_stat(children[i], &info) == -1) {
+					continue; // gone already
+				}
+				const int reparented = (p != NULL);
+				if (p == NULL && (p = add_process(children[i])) == NULL) {
+					continue; // table full
+				}
+				if (orphan_profile_ms > 0) {
+					info.pid = children[i];
+					profile_process(&info, reparented ? p : NULL);
+					p->adopted_ns = info.adopted_ns;
+					p->spawner = info.spawner;
+				}
+				p->ppid = info.ppid;
+				p->start_time = info.start_time;
+				memcpy(p->comm, info.comm, sizeof(p->comm));
+				added ++;
+			}
+			p->generation = tree_generation;
+			tree_order[tree_order_count ++] = children[i];
+		}
+		if (next == tree_order_count) {
+			break;
+		}
+		parent = tree_order[next ++];
+	}
+	if (num_tracked_processes > tree_order_count) {
+		for (int i = 0; i < MAX_TRACKED_PROCESSES; i ++) {
+			if (process_table[i].pid != 0 && process_table[i].generation != tree_generation) {
+				remove_process(process_table[i].pid);
+				i --; // backward shift may have moved another entry here
+			}
+		}
+	}
+	if (added > 0 || orphan_profile_ms == 0) { // the profiler refreshes periodically
+		VERBOSEf("process tree: %d processes (%d new)", tree_order_count, added);
+	}
+	return added;
+}
+
+// Collects all descendants of tinyreaper, parents before their children.
+static int collect_descendants(pid_t* out, int max) {
+	refresh_process_tree();
+	const int n = tree_order_count < max ? tree_order_count : max;
+	memcpy(out, tree_order, n * sizeof(pid_t));
+	return n;
+}
+
+// Used where we must not signal the whole process group (which includes
+// ourselves), e.g. SIGKILL. Skips those in process group skip_pgrp (if not 0).
+static void signal_descendants(int sig, pid_t skip_pgrp) {
+	static pid_t pids[MAX_TRACKED_PROCESSES];
+	const int n = collect_descendants(pids, sizeof(pids) / sizeof(pids[0]));
+	for (int i = 0; i < n; i ++) {
+		if (skip_pgrp == 0 || getpgid(pids[i]) != skip_pgrp) {
+			kill(pids[i], sig);
+		}
+	}
+}
+
+// Logs the processes which survived the grace period.
+static void report_stragglers() {
+	refresh_process_tree();
+	const int max_reported = 20;
+	for (int i = 0; i < tree_order_count && i < max_reported; i ++) {
+		const struct process_info* p = find_process(tree_order[i]);
+		if (p) {
+			LOGf("pid %d (%s) did not exit within grace period", (int)p->pid, p->comm);
+		}
+	}
+	if (tree_order_count > max_reported) {
+		LOGf("... and %d more", tree_order_count - max_reported);
+	}
+}
+
+static int shutdown_in_progress = 0;
+
+// The signal the current shutdown phase sends (SIGTERM, later SIGKILL).
+static int shutdown_signal = SIGTERM;
+
+// Scans our direct children and starts tracking those we do not know yet.
+// Orphans adopted after shutdown started need sig (the current shutdown
+// signal) right away, since they missed the initial round. Those we cannot
+// track (out of pidfds) get sig, if not 0, by pid: that is safe for our own
+// children, their pids cannot be reused before we reap them. Newly tracked
+// ones get it via their pidfd, unless the caller signals all tracked orphans
+// next anyway (signal_tracked == 0).
+static void scan_orphans(int sig, int signal_tracked) {
+	static pid_t children[MAX_TRACKED_PROCESSES];
+	const int n = read_children(getpid(), children, MAX_TRACKED_PROCESSES);
+	for (int i = 0; i < n; i ++) {
+		if (find_command(children[i]) != NULL || is_tracked_orphan(children[i])) {
+			continue;
+		}
+		int pidfd = track_orphan(children[i]);
+		if (pidfd == -1) {
+			if (sig != 0) {
+				kill(children[i], sig);
+			}
+		} else if (sig != 0 && signal_tracked) {
+			sys_pidfd_send_signal(pidfd, sig);
+		}
+	}
+}
+
+static void open_command_pidfd(struct command* cmd) {
+	cmd->pidfd.fd = sys_pidfd_open(cmd->pid);
+	if (cmd->pidfd.fd == -1) {
+		LOGf("Failed to open pidfd for %d - errno: %d (%s)", cmd->pid, errno, strerror(errno));
+		if (use_pidfd) {
+			LOG("Note: Falling back to process group signalling.");
+			use_pidfd = 0;
+		}
+		return;
+	}
+	fcntl(cmd->pidfd.fd, F_SETFD, FD_CLOEXEC);
+	add_event_source(&cmd->pidfd, EPOLLIN);
+}
+
+static void initialize_command_pidfds() {
+	for (int i = 0; i < num_commands; i ++) {
+		if (commands[i].running) {
+			open_command_pidfd(&commands[i]);
+		}
+	}
+}
+
+static void send_signal_to_all_children(int sig) {
+	if (use_cgroup) {
+		// Reaches everything, including processes which left our process group.
+		signal_cgroup(sig, 0);
+		return;
+	}
+	if (use_pidfd) {
+		// Targeted: the command and every adopted orphan, but never ourselves.
+		scan_orphans(sig, 0);
+		for (int i = 0; i < num_commands; i ++) {
+			if (commands[i].pidfd.fd != -1) {
+				sys_pidfd_send_signal(commands[i].pidfd.fd, sig);
+			}
+		}
+		for (int i = 0; i < MAX_ORPHAN_PIDFDS; i ++) {
+			if (orphan_pidfds[i].pid != 0) {
+				sys_pidfd_send_signal(orphan_pidfds[i].fd, sig);
+			}
+		}
+		return;
+	}
+	// We send a signal to the process group, which includes ourselves.
+	// We filter out signals from ourselves when reading the signalfd.
+	if (getpgrp() == getpid()) { // sanity check, am I really process group leader?
+		kill(0, sig);
+	}
+}
+
+////////////////// shutdown ////////////////////////////////////
+
+// Shutdown runs through these phases; each one ends early as soon as we see
+// ECHILD, i.e. there is nothing left to wait for.
+enum shutdown_phase {
+	RUNNING,
+	TERMINATING, // SIGTERM sent, waiting for grace_ms
+	KILLING,     // SIGKILL sent, waiting for kill_timeout_ms
+	FINISHED     // final reap sweep done
+};
+static enum shutdown_phase shutdown_phase = RUNNING;
+
+static uint64_t shutdown_started_ns = 0;
+
+// Set if children remained after the final sweep.
+static int shutdown_failed = 0;
+
+////////////////// staggered termination ////////////////////////////////////
+
+// With --stagger=<n>[,<interval>], SIGTERM goes out in batches of n processes
+// every interval instead of to everyone at once, so that not all workers
+// start their teardown (flushing, closing connections) at the same moment.
+// The order comes from a snapshot of the process tree.
+static int stagger_batch = 0;
+static long stagger_interval_ms = 100;
+static int stagger_leaves_first = 1; // --stagger-order=leaves|parents
+
+#define MAX_STAGGERED MAX_TRACKED_PROCESSES
+
+static pid_t stagger_pids[MAX_STAGGERED];
+static int stagger_count = 0;
+static int stagger_next = 0;
+
+static void handle_stagger_timer(struct event_source* src, uint32_t events);
+static struct event_source stagger_timer = { -1, handle_stagger_timer };
+
+static int compare_pids(const void* a, const void* b) {
+	const pid_t x = *(const pid_t*)a;
+	const pid_t y = *(const pid_t*)b;
+	return x < y ? -1 : (x > y);
+}
+
+// Signals processes which showed up after the snapshot was taken.
+static void signal_latecomers() {
+	static pid_t now[MAX_STAGGERED];
+	qsort(stagger_pids, stagger_count, sizeof(pid_t), compare_pids);
+	const int n = collect_descendants(now, MAX_STAGGERED);
+	int late = 0;
+	for (int i = 0; i < n; i ++) {
+		if (!bsearch(now + i, stagger_pids, stagger_count, sizeof(pid_t), compare_pids)) {
+			kill(now[i], SIGTERM);
+			late ++;
+		}
+	}
+	VERBOSEf("stagger: signalled %d processes spawned during shutdown", late);
+}
+
+static void signal_next_batch() {
+	int end = stagger_next + stagger_batch;
+	if (end > stagger_count) {
+		end = stagger_count;
+	}
+	for (; stagger_next < end; stagger_next ++) {
+		kill(stagger_pids[stagger_next], SIGTERM);
+	}
+	if (stagger_next < stagger_count) {
+		arm_timer(stagger_timer.fd, stagger_interval_ms);
+	} else {
+		signal_latecomers();
+	}
+}
+
+static void handle_stagger_timer(struct event_source* src, uint32_t events) {
+	if (read_timer(src->fd) > 0 && stagger_next < stagger_count) {
+		signal_next_batch();
+	}
+}
+
+static void start_staggered_termination() {
+	stagger_count = collect_descendants(stagger_pids, MAX_STAGGERED);
+	stagger_next = 0;
+	if (stagger_leaves_first) {
+		// collect_descendants() lists parents before children
+		for (int i = 0, j = stagger_count - 1; i < j; i ++, j --) {
+			pid_t tmp = stagger_pids[i];
+			stagger_pids[i] = stagger_pids[j];
+			stagger_pids[j] = tmp;
+		}
+	}
+	// Respect the deadline: the last batch goes out at half the grace period
+	// at the latest, so the last processes still get time to finish.
+	const int batches = (stagger_count + stagger_batch - 1) / stagger_batch;
+	if (batches > 1 && stagger_interval_ms * (batches - 1) > grace_ms / 2) {
+		stagger_interval_ms = (grace_ms / 2) / (batches - 1);
+		if (stagger_interval_ms == 0) {
+			stagger_interval_ms = 1;
+		}
+	}
+	VERBOSEf("stagger: %d processes in %d batches, every %ldms", stagger_count, batches, stagger_interval_ms);
+	signal_next_batch();
+}
+
+static void stop_staggered_termination() {
+	stagger_next = stagger_count;
+	if (stagger_timer.fd == -1) {
+		return; // no --stagger
+	}
+	arm_timer(stagger_timer.fd, 0);
+}
+
+static void initialize_stagger_timer() {
+	stagger_timer.fd = create_timer();
+	add_event_source(&stagger_timer, EPOLLIN);
+}
+
+static void handle_shutdown_timer(struct event_source* src, uint32_t events);
+static struct event_source shutdown_timer = { -1, handle_shutdown_timer };
+
+static void start_shutdown() {
+	if (shutdown_in_progress) {
+		VERBOSE("Shutdown already in progress.");
+		return;
+	}
+	shutdown_in_progress = 1;
+	shutdown_started_ns = now_ns();
+	cancel_restarts();
+	cancel_standby();
+	close_relay_write_ends();
+	shutdown_phase = TERMINATING;
+	// send SIGTERM to all kids, then start the death clock.
+	LOG("Terminating children...");
+	TRACE2(shutdown, "terminating", SIGTERM);
+	emit_phase_event("terminating", SIGTERM);
+	if (stagger_batch > 0) {
+		start_staggered_termination();
+	} else {
+		send_signal_to_all_children(SIGTERM);
+	}
+	resume_stopped_spawners(); // so they see the SIGTERM
+
+	VERBOSE("tick tock...");
+	arm_deadline(shutdown_timer.fd, grace_ms);
+}
+
+static void start_killing() {
+	shutdown_phase = KILLING;
+	shutdown_signal = SIGKILL;
+	stop_staggered_termination();
+	LOG("Grace period expired. Killing children...");
+	TRACE2(shutdown, "killing", SIGKILL);
+	emit_phase_event("killing", SIGKILL);
+	if (use_cgroup) {
+		kill_cgroup();
+	} else if (use_pidfd) {
+		send_signal_to_all_children(SIGKILL);
+	} else {
+		// Not via the process group, since that would include ourselves.
+		signal_descendants(SIGKILL, 0);
+	}
+	arm_deadline(shutdown_timer.fd, kill_timeout_ms);
+}
+
+// The terminal phase, however we got there: the shutdown timed out, every
+// child is gone, or the first command could not be started.
+static void enter_finished_phase() {
+	if (shutdown_phase != FINISHED) {
+		shutdown_phase = FINISHED;
+		TRACE2(shutdown, "finished", 0);
+		emit_phase_event("finished", 0);
+	}
+}
+
+static void finish_shutdown() {
+	enter_finished_phase();
+	// Last chance: collect whatever exited in the meantime.
+	reap_children();
+	if (!event_loop_done) {
+		static pid_t pids[1024];
+		const int n = read_children(getpid(), pids, sizeof(pids) / sizeof(pids[0]));
+		LOGf("Shutdown timeout. %d children did not terminate.", n);
+		shutdown_failed = 1;
+		event_loop_done = 1;
+	}
+}
+
+static void handle_shutdown_timer(struct event_source* src, uint32_t events) {
+	// The timer is only armed during shutdown; firing means the current
+	// phase timed out.
+	if (read_timer(src->fd) == 0) {
+		return;
+	}
+	switch (shutdown_phase) {
+		case TERMINATING:
+			report_stragglers();
+			if (kill_timeout_ms >= 0) {
+				start_killing();
+			} else {
+				finish_shutdown();
+			}
+			break;
+		case KILLING:
+			finish_shutdown();
+			break;
+		default:
+			break;
+	}
+}
+
+static void initialize_shutdown_timer() {
+	shutdown_timer.fd = create_timer();
+	add_event_source(&shutdown_timer, EPOLLIN);
+}
+
+////////////////// exit logging ////////////////////////////////////
+
+// Summary mode (--log-summary[=<interval>]): instead of one line per exit, exits
+// are counted and logged as one line per interval. Individual lines are only
+// written for failed or signalled children, at most --log-rate per interval.
+// The command's exit is always logged on its own line.
+static long log_summary_ms = 0; // 0: log every exit
+static int log_rate = 10;
+
+static struct {
+	unsigned long exited[256]; // by exit code
+	unsigned long killed[NSIG]; // by signal
+	unsigned long total;
+	int lines; // individual lines logged this interval
+} exit_summary;
+
+static void handle_summary_timer(struct event_source* src, uint32_t events);
+static struct event_source summary_timer = { -1, handle_summary_timer };
+
+static void log_exit_summary() {
+	if (exit_summary.total == 0) {
+		return;
+	}
+	char line[512];
+	size_t len;
+	if (log_summary_ms % 1000 == 0) {
+		len = format(line, sizeof(line), "tinyreaper: last %lds:", log_summary_ms / 1000);
+	} else {
+		len = format(line, sizeof(line), "tinyreaper: last %ldms:", log_summary_ms);
+	}
+	const char* sep = " ";
+	for (int code = 0; code < 256; code ++) {
+		if (exit_summary.exited[code] > 0) {
+			len += format(line + len, sizeof(line) - len, "%s%lu exited %d", sep, exit_summary.exited[code], code);
+			sep = ", ";
+		}
+	}
+	for (int sig = 0; sig < NSIG; sig ++) {
+		if (exit_summary.killed[sig] > 0) {
+			len += format(line + len, sizeof(line) - len, "%s%lu killed by %d", sep, exit_summary.killed[sig], sig);
+			sep = ", ";
+		}
+	}
+	if (len < sizeof(line) - 1) {
+		line[len ++] = '\n';
+	} else {
+		line[len - 1] = '\n'; // truncated
+	}
+	write_log(line, len);
+	memset(&exit_summary, 0, sizeof(exit_summary));
+}
+
+static void handle_summary_timer(struct event_source* src, uint32_t events) {
+	if (read_timer(src->fd) > 0) {
+		log_exit_summary();
+	}
+}
+
+static void log_exit(pid_t pid, int status) {
+	if (log_summary_ms == 0 || find_command(pid) != NULL) {
+		LOG_process_state(pid, status);
+		return;
+	}
+	exit_summary.total ++;
+	if (WIFEXITED(status)) {
+		exit_summary.exited[WEXITSTATUS(status)] ++;
+		if (WEXITSTATUS(status) == 0) {
+			return;
+		}
+	} else if (WIFSIGNALED(status) && WTERMSIG(status) < NSIG) {
+		exit_summary.killed[WTERMSIG(status)] ++;
+	}
+	if (exit_summary.lines < log_rate) {
+		exit_summary.lines ++;
+		LOG_process_state(pid, status);
+	}
+}
+
+static void initialize_exit_summary() {
+	summary_timer.fd = create_timer();
+	add_event_source(&summary_timer, EPOLLIN);
+	arm_periodic_timer(summary_timer.fd, log_summary_ms);
+	atexit(log_exit_summary); // registered after drain_log, so it runs before it
+}
+
+////////////////// rusage ////////////////////////////////////
+
+// --rusage[=<n>]: resource usage of reaped children, which the kernel hands
+// us with the reap anyway, summed up per comm. The top <n> CPU consumers are
+// logged at exit and on SIGUSR1. To know the comm, we peek at the zombie
+// first (waitid with WNOWAIT) unless the process tree already knows it.
+#define MAX_RUSAGE_ENTRIES 256 // power of two
+
+static int rusage_top = 0;
+
+struct rusage_entry {
+	char comm[16]; // "": free slot
+	unsigned long count;
+	uint64_t utime_us;
+	uint64_t stime_us;
+	long max_rss_kb;
+	unsigned long minflt;
+	unsigned long majflt;
+};
+
+static struct rusage_entry rusage_table[MAX_RUSAGE_ENTRIES];
+static int num_rusage_entries = 0;
+static struct rusage_entry rusage_other = { "(other)" }; // once the table is full
+
+// glibc's waitid does not pass the rusage argument of the system call.
+static int sys_waitid(idtype_t idtype, id_t id, siginfo_t* info, int options, struct rusage* ru) {
+	return (int)syscall(__NR_waitid, idtype, id, info, options, ru);
+}
+
+static unsigned comm_hash(const char* comm) {
+	unsigned h = 2166136261u;
+	for (; *comm; comm ++) {
+		h = (h ^ (unsigned char)*comm) * 16777619u;
+	}
+	return h % MAX_RUSAGE_ENTRIES;
+}
+
+static struct rusage_entry* rusage_entry(const char* comm) {
+	unsigned idx = comm_hash(comm);
+	while (rusage_table[idx].comm[0] != '\0') {
+		if (strcmp(rusage_table[idx].comm, comm) == 0) {
+			return rusage_table + idx;
+		}
+		idx = (idx + 1) % MAX_RUSAGE_ENTRIES;
+	}
+	if (num_rusage_entries >= MAX_RUSAGE_ENTRIES - 1) {
+		return &rusage_other; // keep one slot free so lookups terminate
+	}
+	num_rusage_entries ++;
+	format(rusage_table[idx].comm, sizeof(rusage_table[idx].comm), "%s", comm);
+	return rusage_table + idx;
+}
+
+// The name of an exited, not yet reaped child.
+static void zombie_comm(pid_t pid, char* comm, size_t size) {
+	struct process_info* info = find_process(pid);
+	if (info != NULL) {
+		format(comm, size, "%s", info->comm);
+		return;
+	}
+	char path[64];
+	format(path, sizeof(path), "/proc/%d/comm", (int)pid);
+	ssize_t len = read_file(path, comm, size);
+	if (len <= 0) {
+		format(comm, size, "?");
+		return;
+	}
+	if (comm[len - 1] == '\n') {
+		comm[len - 1] = '\0';
+	}
+}
+
+static uint64_t timeval_us(const struct timeval* tv) {
+	return (uint64_t)tv->tv_sec * 1000000ull + (uint64_t)tv->tv_usec;
+}
+
+static void record_rusage(const char* comm, const struct rusage* ru) {
+	struct rusage_entry* e = rusage_entry(comm);
+	e->count ++;
+	e->utime_us += timeval_us(&ru->ru_utime);
+	e->stime_us += timeval_us(&ru->ru_stime);
+	if (ru->ru_maxrss > e->max_rss_kb) {
+		e->max_rss_kb = ru->ru_maxrss;
+	}
+	e->minflt += (unsigned long)ru->ru_minflt;
+	e->majflt += (unsigned long)ru->ru_majflt;
+}
+
+static uint64_t rusage_cpu_us(const struct rusage_entry* e) {
+	return e->utime_us + e->stime_us;
+}
+
+static void log_rusage() {
+	if (rusage_top == 0) {
+		return;
+	}
+	// Selection of the top n by CPU time; n is small.
+	const struct rusage_entry* top[MAX_RUSAGE_ENTRIES + 1];
+	int n = 0;
+	for (int i = 0; i <= MAX_RUSAGE_ENTRIES; i ++) {
+		const struct rusage_entry* e = (i < MAX_RUSAGE_ENTRIES) ? rusage_table + i : &rusage_other;
+		if (e->count > 0) {
+			top[n ++] = e;
+		}
+	}
+	if (n == 0) {
+		LOG("rusage: no children reaped yet");
+		return;
+	}
+	LOGf("rusage: top %d of %d by CPU time", n < rusage_top ? n : rusage_top, n);
+	for (int i = 0; i < n && i < rusage_top; i ++) {
+		int max = i;
+		for (int j = i + 1; j < n; j ++) {
+			if (rusage_cpu_us(top[j]) > rusage_cpu_us(top[max])) {
+				max = j;
+			}
+		}
+		const struct rusage_entry* e = top[max];
+		top[max] = top[i];
+		top[i] = e;
+		LOGf("  %-15s %6lu reaped, user %llu.%03llus, sys %llu.%03llus, max rss %ldK, faults %lu/%lu",
+		     e->comm, e->count,
+		     (unsigned long long)(e->utime_us / 1000000), (unsigned long long)(e->utime_us / 1000 % 1000),
+		     (unsigned long long)(e->stime_us / 1000000), (unsigned long long)(e->stime_us / 1000 % 1000),
+		     e->max_rss_kb, e->minflt, e->majflt);
+	}
+}
+
+////////////////// orphan profile ////////////////////////////////////
+
+// --orphan-profile[=<interval>]: who leaks orphans, and how long do they live?
+// The process tree is refreshed every <interval> (default: 1s). A process we
+// saw below another one and then as our own child got adopted; its spawner is
+// the comm of the parent it had. At reap time, its lifetime (from its start
+// time) goes into a log2 histogram per spawner. Orphans which were adopted
+// before a refresh saw them count as spawned by "?".
+#define MAX_SPAWNERS 64 // power of two
+#define LIFETIME_BUCKETS 32
+
+static int orphan_profile_ms = 0;
+
+struct spawner_profile {
+	char comm[16]; // "": free slot
+	unsigned long orphans;
+	unsigned long buckets[LIFETIME_BUCKETS]; // bucket i: lifetime below 2^i ms
+	uint64_t max_lifetime_ms;
+	uint64_t max_orphaned_ms; // time from adoption to reap
+};
+
+static struct spawner_profile spawners[MAX_SPAWNERS];
+static int num_spawners = 0;
+static unsigned long orphans_unprofiled = 0; // reaped before any refresh saw them
+
+static void handle_profile_timer(struct event_source* src, uint32_t events);
+static struct event_source profile_timer = { -1, handle_profile_timer };
+
+// Returns the slot + 1 of comm, 0 if the table is full.
+static int spawner_slot(const char* comm) {
+	unsigned idx = comm_hash(comm) % MAX_SPAWNERS;
+	while (spawners[idx].comm[0] != '\0') {
+		if (strcmp(spawners[idx].comm, comm) == 0) {
+			return (int)idx + 1;
+		}
+		idx = (idx + 1) % MAX_SPAWNERS;
+	}
+	if (num_spawners >= MAX_SPAWNERS - 1) {
+		return 0; // keep one slot free so lookups terminate
+	}
+	num_spawners ++;
+	format(spawners[idx].comm, sizeof(spawners[idx].comm), "%s", comm);
+	return (int)idx + 1;
+}
+
+// Called by refresh_process_tree() for a process which is new, or has a new
+// parent (then previous is what we knew about it); fills in the profile fields.
+static void profile_process(struct process_info* p, const struct process_info* previous) {
+	p->adopted_ns = 0;
+	p->spawner = 0;
+	if (find_command(p->pid) != NULL) {
+		return;
+	}
+	if (p->ppid == getpid()) {
+		p->adopted_ns = now_ns();
+		p->spawner = previous ? previous->spawner : spawner_slot("?");
+		if (!use_pidfd) { // else reported by track_orphan()
+			TRACE1(adopt, p->pid);
+			emit_adopt_event(p->pid, p->comm);
+		}
+	} else {
+		// Its parent was seen earlier in this walk.
+		const struct process_info* parent = find_process(p->ppid);
+		p->spawner = parent ? spawner_slot(parent->comm) : 0;
+	}
+}
+
+static uint64_t boottime_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Called when we reaped an orphan, before it is dropped from the process tree.
+static void record_orphan_lifetime(pid_t pid) {
+	const struct process_info* p = find_process(pid);
+	if (p == NULL || p->adopted_ns == 0 || p->spawner == 0) {
+		orphans_unprofiled ++;
+		return;
+	}
+	static long ticks = 0;
+	if (ticks == 0) {
+		ticks = sysconf(_SC_CLK_TCK);
+	}
+	const uint64_t started_ms = p->start_time * 1000 / (uint64_t)ticks;
+	const uint64_t now_ms = boottime_ms();
+	const uint64_t lifetime_ms = now_ms > started_ms ? now_ms - started_ms : 0;
+	const uint64_t orphaned_ms = (now_ns() - p->adopted_ns) / 1000000;
+	struct spawner_profile* s = spawners + p->spawner - 1;
+	int bucket = 0;
+	while (bucket < LIFETIME_BUCKETS - 1 && (1ull << bucket) <= lifetime_ms) {
+		bucket ++;
+	}
+	s->buckets[bucket] ++;
+	s->orphans ++;
+	if (lifetime_ms > s->max_lifetime_ms) {
+		s->max_lifetime_ms = lifetime_ms;
+	}
+	if (orphaned_ms > s->max_orphaned_ms) {
+		s->max_orphaned_ms = orphaned_ms;
+	}
+}
+
+static unsigned long long lifetime_percentile(const struct spawner_profile* s, int percent) {
+	const unsigned long rank = (s->orphans * percent + 99) / 100;
+	unsigned long seen = 0;
+	for (int i = 0; i < LIFETIME_BUCKETS; i ++) {
+		seen += s->buckets[i];
+		if (seen >= rank && seen > 0) {
+			return 1ull << i;
+		}
+	}
+	return 0;
+}
+
+static void log_orphan_profile() {
+	if (orphan_profile_ms == 0) {
+		return;
+	}
+	LOGf("orphan lifetimes by spawner (%lu orphans not profiled):", orphans_unprofiled);
+	for (int i = 0; i < MAX_SPAWNERS; i ++) {
+		const struct spawner_profile* s = spawners + i;
+		if (s->orphans > 0) {
+			LOGf("  %-15s %6lu orphans, p50 < %llums, p99 < %llums, max %llums (orphaned %llums)",
+			     s->comm, s->orphans, lifetime_percentile(s, 50), lifetime_percentile(s, 99),
+			     (unsigned long long)s->max_lifetime_ms, (unsigned long long)s->max_orphaned_ms);
+		}
+	}
+}
+
+static void handle_profile_timer(struct event_source* src, uint32_t events) {
+	if (read_timer(src->fd) > 0) {
+		refresh_process_tree();
+	}
+}
+
+static void initialize_orphan_profile() {
+	profile_timer.fd = create_timer();
+	add_event_source(&profile_timer, EPOLLIN);
+	arm_periodic_timer(profile_timer.fd, orphan_profile_ms);
+}
+
+////////////////// reap latency ////////////////////////////////////
+
+// Histogram of the time from a child's exit (as far as we can tell, see
+// events_observed_ns) to the moment we collect it. Bucket i counts latencies
+// below 2^i microseconds (and at least 2^(i-1)).
+#define LATENCY_BUCKETS 32
+
+static struct {
+	unsigned long buckets[LATENCY_BUCKETS];
+	unsigned long count;
+	uint64_t sum_us;
+	uint64_t max_us;
+} reap_latency;
+
+// Returns the latency in microseconds.
+static uint64_t record_reap_latency(uint64_t reaped_ns) {
+	const uint64_t us = reaped_ns > events_observed_ns ? (reaped_ns - events_observed_ns) / 1000 : 0;
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS - 1 && (1ull << bucket) <= us) {
+		bucket ++;
+	}
+	reap_latency.buckets[bucket] ++;
+	reap_latency.count ++;
+	reap_latency.sum_us += us;
+	if (us > reap_latency.max_us) {
+		reap_latency.max_us = us;
+	}
+	return us;
+}
+
+// Upper bound of the bucket containing the given percentile, in microseconds.
+static unsigned long long latency_percentile(int percent) {
+	const unsigned long rank = (reap_latency.count * percent + 99) / 100;
+	unsigned long seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i ++) {
+		seen += reap_latency.buckets[i];
+		if (seen >= rank && seen > 0) {
+			return 1ull << i;
+		}
+	}
+	return 0;
+}
+
+static void log_reap_latency() {
+	if (reap_latency.count == 0) {
+		LOG("reap latency: no children reaped yet");
+		return;
+	}
+	LOGf("reap latency: %lu reaped, p50 < %lluus, p99 < %lluus, max %lluus",
+	     reap_latency.count, latency_percentile(50), latency_percentile(99),
+	     (unsigned long long)reap_latency.max_us);
+	for (int i = 0; i < LATENCY_BUCKETS; i ++) {
+		if (reap_latency.buckets[i] > 0) {
+			LOGf("  < %lluus: %lu", 1ull << i, reap_latency.buckets[i]);
+		}
+	}
+}
+
+// Reports are logged on SIGUSR1, and at exit with --report.
+enum { REPORT_NONE, REPORT_TEXT, REPORT_JSON };
+static int report_at_exit = REPORT_NONE;
+
+static void log_reports() {
+	log_reap_latency();
+	log_rusage();
+	log_orphan_profile();
+}
+
+////////////////// reaping ////////////////////////////////////
+
+// What to do when one of several commands exits.
+enum exit_policy {
+	ON_EXIT_SHUTDOWN, // shut down everything
+	ON_EXIT_IGNORE    // keep going until the last command exited
+};
+static enum exit_policy exit_policy = ON_EXIT_SHUTDOWN;
+
+// Children are reaped in batches: we collect as many exited children as we
+// can without blocking, then hand the whole batch to logging/accounting.
+#define REAP_BATCH_SIZE 256
+
+struct reaped_child {
+	pid_t pid;
+	int status; // wait(2) style status
+};
+
+static struct {
+	unsigned long reaped;
+	unsigned long orphans_reaped;
+	unsigned peak_batch;    // at most REAP_BATCH_SIZE
+	unsigned peak_backlog;  // most children reaped in one pass, i.e. the zombie backlog we found
+	// reaped per second, for rates
+	uint64_t second;
+	unsigned long reaped_this_second;
+	unsigned long reaped_last_second;
+	// when we reaped the first and the last child
+	uint64_t first_reap_ns;
+	uint64_t last_reap_ns;
+} stats;
+
+static void update_reap_rate(uint64_t now, unsigned long reaped) {
+	const uint64_t second = now / 1000000000ull;
+	if (second != stats.second) {
+		stats.reaped_last_second = (second == stats.second + 1) ? stats.reaped_this_second : 0;
+		stats.reaped_this_second = 0;
+		stats.second = second;
+	}
+	stats.reaped_this_second += reaped;
+}
+
+static unsigned long reaped_last_second() {
+	update_reap_rate(now_ns(), 0);
+	return stats.reaped_last_second;
+}
+
+// Translate the waitid(2) result into a wait(2) style status.
+static int siginfo_to_status(const siginfo_t* info) {
+	switch (info->si_code) {
+		case CLD_EXITED: return (info->si_status & 0xff) << 8;
+		case CLD_KILLED: return info->si_status & 0x7f;
+		case CLD_DUMPED: return (info->si_status & 0x7f) | 0x80;
+	}
+	return 0;
+}
+
+// see restart
+static int restarts_pending = 0;
+static int schedule_restart(struct command* cmd);
+// see readiness
+static void reset_readiness();
+
+static void command_finished(struct command* cmd, int status) {
+	VERBOSEf("%s finished.", cmd->argv[0]);
+	if (cmd->pidfd.fd != -1) {
+		close(cmd->pidfd.fd);
+		cmd->pidfd.fd = -1;
+	}
+	cmd->status = status;
+	cmd->running = 0;
+	command_running --;
+	if (schedule_restart(cmd)) {
+		if (cmd == &commands[0]) {
+			reset_readiness();
+		}
+		return;
+	}
+	if (cmd == &commands[0]) {
+		fail_readiness();
+	}
+	if (exit_policy == ON_EXIT_IGNORE && command_running > 0) {
+		VERBOSEf("%d command(s) still running.", command_running);
+		return;
+	}
+	if (shutdown_in_progress) {
+		return;
+	}
+	// Those we terminate now did not fail on their own.
+	for (int i = 0; i < num_commands; i ++) {
+		commands[i].stopped = commands[i].running;
+	}
+	// The command finished.
+	// We now terminate any remaining children and continue to wait
+	// until they finish too. We also set a death clock. If all children
+	// finish in time, or if there are no remaining children, we will leave
+	// the loop and exit. If children remain, we will eventually run out of
+	// time and terminate ourselves.
+	start_shutdown();
+}
+
+static void process_reaped_children(const struct reaped_child* batch, int n) {
+	for (int i = 0; i < n; i ++) {
+		log_exit(batch[i].pid, batch[i].status);
+		struct command* cmd = find_command(batch[i].pid);
+		if (cmd != NULL) {
+			command_finished(cmd, batch[i].status);
+		} else if (standby_exited(batch[i].pid)) {
+			untrack_orphan(batch[i].pid);
+		} else {
+			untrack_orphan(batch[i].pid);
+			stats.orphans_reaped ++;
+			if (orphan_profile_ms > 0) {
+				record_orphan_lifetime(batch[i].pid);
+			}
+		}
+		if (num_tracked_processes > 0) {
+			remove_process(batch[i].pid);
+		}
+	}
+	const uint64_t now = now_ns();
+	if (stats.reaped == 0) {
+		stats.first_reap_ns = now;
+	}
+	stats.last_reap_ns = now;
+	stats.reaped += n;
+	update_reap_rate(now, n);
+	if ((unsigned)n > stats.peak_batch) {
+		stats.peak_batch = n;
+	}
+}
+
+// Whether the adopt event for pid went out already: when we started tracking
+// it (--pidfd), or when we saw it in the process tree.
+static int adoption_reported(pid_t pid) {
+	if (use_pidfd) {
+		return is_tracked_orphan(pid);
+	}
+	const struct process_info* p = find_process(pid);
+	return p != NULL && p->adopted_ns != 0;
+}
+
+// Reaps all children which are ready to be reaped without blocking.
+static void reap_children() {
+	struct reaped_child batch[REAP_BATCH_SIZE];
+	int n = 0;
+	int reaped = 0;
+	int no_children = 0;
+	TRACE0(drain__start);
+	// For --rusage and events, we learn the comm before we reap.
+	const int peek = rusage_top > 0 || events_enabled();
+	for (;;) {
+		siginfo_t info;
+		info.si_pid = 0; // waitid leaves it untouched if nothing is ready
+		if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | (peek ? WNOWAIT : 0)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == ECHILD) {
+				no_children = 1;
+			} else {
+				LOGf("waitid failed - errno: %d (%s)", errno, strerror(errno));
+			}
+			break;
+		}
+		if (info.si_pid == 0) {
+			// Children remain, but none has exited yet.
+			break;
+		}
+		char comm[16] = "";
+		struct rusage ru;
+		if (peek) {
+			zombie_comm(info.si_pid, comm, sizeof(comm));
+			if (sys_waitid(P_PID, (id_t)info.si_pid, &info, WEXITED, &ru) == -1) {
+				continue;
+			}
+			if (rusage_top > 0) {
+				record_rusage(comm, &ru);
+			}
+		}
+		const uint64_t reaped_ns = now_ns();
+		const uint64_t latency_us = record_reap_latency(reaped_ns);
+		batch[n].pid = info.si_pid;
+		batch[n].status = siginfo_to_status(&info);
+		const int is_command = find_command(batch[n].pid) != NULL;
+		if (!is_command && !is_standby(batch[n].pid) && !adoption_reported(batch[n].pid)) {
+			// An orphan which exited before we noticed it had been adopted.
+			TRACE1(adopt, batch[n].pid);
+			emit_adopt_event(batch[n].pid, comm[0] != '\0' ? comm : NULL);
+		}
+		TRACE3(reap, batch[n].pid, batch[n].status, latency_us);
+		reaped ++;
+		emit_exit_event(batch[n].pid, comm, batch[n].status, is_command, peek ? &ru : NULL);
+		record_recent_exit(batch[n].pid, batch[n].status, reaped_ns);
+		n ++;
+		if (n == REAP_BATCH_SIZE) {
+			process_reaped_children(batch, n);
+			n = 0;
+		}
+	}
+	if (n > 0) {
+		process_reaped_children(batch, n);
+	}
+	TRACE2(drain__done, reaped, no_children);
+	if ((unsigned)reaped > stats.peak_backlog) {
+		stats.peak_backlog = reaped;
+	}
+	if (use_pidfd && !no_children) {
+		scan_orphans(shutdown_in_progress ? shutdown_signal : 0, 1);
+	}
+	if (no_children && restarts_pending == 0) {
+		VERBOSE("all child processes terminated.");
+		VERBOSEf("reaped %lu children, peak backlog: %u, peak batch size: %u", stats.reaped, stats.peak_backlog, stats.peak_batch);
+		event_loop_done = 1;
+	}
+}
+
+// --report=json: how we did, as one line of JSON, for benchmarks (see
+// examples/bench.sh).
+static void log_json_report() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	LOGf("report {\"reaped\":%lu,\"orphans_reaped\":%lu,\"reaping_ms\":%llu,\"peak_backlog\":%u,\"peak_batch\":%u,"
+	     "\"latency_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu},"
+	     "\"utime_ms\":%llu,\"stime_ms\":%llu,\"maxrss_kb\":%ld}",
+	     stats.reaped, stats.orphans_reaped,
+	     (unsigned long long)((stats.last_reap_ns - stats.first_reap_ns) / 1000000),
+	     stats.peak_backlog, stats.peak_batch,
+	     latency_percentile(50), latency_percentile(90), latency_percentile(99),
+	     (unsigned long long)reap_latency.max_us,
+	     (unsigned long long)ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000,
+	     (unsigned long long)ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000,
+	     ru.ru_maxrss);
+}
+
+////////////////// pid pressure ////////////////////////////////////
+
+// A fork bomb below us must not exhaust the pid space of the whole node.
+// --pids-max=<n> caps the command's tree: via pids.max of the command cgroup in
+// cgroup mode, else via RLIMIT_NPROC (which counts all processes of the user,
+// and does not apply to root).
+// --pid-pressure=<n>[,<rate>] checks once per second whether more than <n>
+// descendants live, or more than <rate> children exited per second; if that
+// lasts for --pid-pressure-time (default: 3s), --pid-pressure-action is taken:
+// log, stop (SIGSTOP the process with the most children, once per second while
+// the overload lasts) or shutdown.
+static long pids_max = 0;
+static int pids_max_via_rlimit = 0;
+static int pressure_max_descendants = 0;
+static unsigned long pressure_max_rate = 0; // 0: not checked
+static long pressure_time_ms = 3000;
+
+enum pressure_action {
+	PRESSURE_LOG,
+	PRESSURE_STOP,
+	PRESSURE_SHUTDOWN
+};
+static enum pressure_action pressure_action = PRESSURE_LOG;
+
+static long overloaded_ms = 0; // how long the overload lasts so far
+static int pressure_reported = 0;
+
+// Spawners we stopped, resumed when we shut down.
+#define MAX_STOPPED_SPAWNERS 16
+static pid_t stopped_spawners[MAX_STOPPED_SPAWNERS];
+static int num_stopped_spawners = 0;
+
+static void handle_pressure_timer(struct event_source* src, uint32_t events);
+static struct event_source pressure_timer = { -1, handle_pressure_timer };
+
+// Enables the pids controller for our child cgroups (which may fail, e.g. if
+// our own cgroup has processes in it and is not the root) and sets pids.max.
+static int set_cgroup_pids_max() {
+	char path[PATH_MAX];
+	format(path, sizeof(path), "%s", cgroup_dir);
+	char* slash = strrchr(path, '/');
+	if (slash == NULL) {
+		return -1;
+	}
+	format(slash, sizeof(path) - (size_t)(slash - path), "/cgroup.subtree_control");
+	write_file(path, "+pids"); // may be enabled already
+	char value[32];
+	format(value, sizeof(value), "%ld", pids_max);
+	cgroup_file(path, sizeof(path), "pids.max");
+	return write_file(path, value);
+}
+
+// In the (vforked) child, without cgroup.
+static int set_nproc_limit() {
+	struct rlimit rl = { (rlim_t)pids_max, (rlim_t)pids_max };
+	return setrlimit(RLIMIT_NPROC, &rl);
+}
+
+static void initialize_pids_max() {
+	if (use_cgroup) {
+		if (set_cgroup_pids_max() == 0) {
+			VERBOSEf("pids.max: %ld", pids_max);
+			return;
+		}
+		LOGf("Failed to set pids.max - errno: %d (%s)", errno, strerror(errno));
+		LOG("Note: Falling back to RLIMIT_NPROC.");
+	}
+	pids_max_via_rlimit = 1;
+}
+
+static int descendant_count() {
+	if (use_cgroup) {
+		char path[PATH_MAX];
+		char buf[32];
+		cgroup_file(path, sizeof(path), "pids.current");
+		if (read_file(path, buf, sizeof(buf)) > 0) {
+			return atoi(buf); // cheaper than walking the tree
+		}
+	}
+	refresh_process_tree();
+	return tree_order_count;
+}
+
+static int spawner_stopped(pid_t pid) {
+	for (int i = 0; i < num_stopped_spawners; i ++) {
+		if (stopped_spawners[i] == pid) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// The process with the most children, per the last refresh. Commands and
+// those we stopped already do not count. Siblings are adjacent in tree_order.
+static pid_t biggest_spawner() {
+	pid_t biggest = 0;
+	int most = 0;
+	for (int i = 0; i < tree_order_count; ) {
+		const struct process_info* p = find_process(tree_order[i]);
+		int siblings = 1;
+		while (p != NULL && i + siblings < tree_order_count) {
+			const struct process_info* next = find_process(tree_order[i + siblings]);
+			if (next == NULL || next->ppid != p->ppid) {
+				break;
+			}
+			siblings ++;
+		}
+		if (p != NULL && p->ppid != getpid() && siblings > most && siblings > 1 &&
+		    find_command(p->ppid) == NULL && !spawner_stopped(p->ppid)) {
+			most = siblings;
+			biggest = p->ppid;
+		}
+		i += siblings;
+	}
+	return biggest;
+}
+
+static void stop_biggest_spawner() {
+	const pid_t pid = biggest_spawner();
+	if (pid == 0) {
+		return;
+	}
+	const struct process_info* p = find_process(pid);
+	if (kill(pid, SIGSTOP) == 0) {
+		LOGf("Stopped pid %d (%s), the biggest spawner.", (int)pid, p ? p->comm : "?");
+		if (num_stopped_spawners < MAX_STOPPED_SPAWNERS) {
+			stopped_spawners[num_stopped_spawners ++] = pid;
+		}
+	}
+}
+
+static void resume_stopped_spawners() {
+	for (int i = 0; i < num_stopped_spawners; i ++) {
+		kill(stopped_spawners[i], SIGCONT);
+	}
+	num_stopped_spawners = 0;
+}
+
+static void handle_pressure_timer(struct event_source* src, uint32_t events) {
+	if (read_timer(src->fd) == 0 || shutdown_in_progress) {
+		return;
+	}
+	const int descendants = descendant_count();
+	const unsigned long rate = reaped_last_second();
+	const int overloaded = descendants > pressure_max_descendants ||
+	                       (pressure_max_rate > 0 && rate > pressure_max_rate);
+	if (!overloaded) {
+		if (pressure_reported) {
+			LOGf("pid pressure over: %d descendants, %lu exits/s", descendants, rate);
+		}
+		overloaded_ms = 0;
+		pressure_reported = 0;
+		return;
+	}
+	overloaded_ms += 1000;
+	if (overloaded_ms < pressure_time_ms) {
+		return;
+	}
+	static const char* actions[] = { "log", "stop", "shutdown" };
+	if (!pressure_reported) {
+		pressure_reported = 1;
+		LOGf("pid pressure: %d descendants, %lu exits/s for %lds", descendants, rate, overloaded_ms / 1000);
+		emit_event("pressure", "\"descendants\":%d,\"rate\":%lu,\"action\":\"%s\"",
+		           descendants, rate, actions[pressure_action]);
+	}
+	switch (pressure_action) {
+		case PRESSURE_LOG:
+			break;
+		case PRESSURE_STOP:
+			if (use_cgroup) {
+				refresh_process_tree(); // pids.current does not tell who
+			}
+			stop_biggest_spawner();
+			break;
+		case PRESSURE_SHUTDOWN:
+			LOG("Shutting down under pid pressure.");
+			start_shutdown();
+			break;
+	}
+}
+
+static void initialize_pid_pressure() {
+	pressure_timer.fd = create_timer();
+	add_event_source(&pressure_timer, EPOLLIN);
+	arm_periodic_timer(pressure_timer.fd, 1000);
+}
+
+////////////////// stats page ////////////////////////////////////
+
+// --stats-file=<path>: a fixed-layout page in a shared file (e.g. under
+// /dev/shm) which monitoring agents can mmap and poll without any syscall
+// into us. It is updated once per event loop iteration under a seqlock:
+// sequence is odd while an update is in progress; readers copy the page and
+// retry if sequence was odd or changed meanwhile. All fields are native
+// endian; times are CLOCK_MONOTONIC nanoseconds.
+#define STATS_PAGE_MAGIC 0x52505254u // "TRPR"
+#define STATS_PAGE_VERSION 1
+#define STATS_PAGE_RECENT_EXITS 32
+
+struct stats_page_exit {
+	int32_t pid;
+	int32_t status; // wait(2) style
+	uint64_t reaped_ns;
+};
+
+struct stats_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;            // sizeof(struct stats_page)
+	int32_t reaper_pid;
+	uint64_t sequence;
+	uint64_t updated_ns;
+	uint64_t reaped;
+	uint64_t orphans_reaped;
+	uint64_t log_dropped;
+	uint32_t peak_batch;
+	uint32_t shutdown_phase;  // 0 running, 1 terminating, 2 killing, 3 finished
+	uint64_t shutdown_started_ns;
+	int32_t command_pid;
+	int32_t command_running;
+	uint64_t latency_count;
+	uint64_t latency_buckets[LATENCY_BUCKETS]; // as in the reap latency report
+	uint32_t recent_exits_next; // slot the next exit goes to
+	uint32_t reserved;
+	struct stats_page_exit recent_exits[STATS_PAGE_RECENT_EXITS];
+};
+
+static const char* stats_file = NULL;
+static struct stats_page* stats_page = NULL;
+
+// The last exits, kept here and copied into the page on update.
+static struct stats_page_exit recent_exits[STATS_PAGE_RECENT_EXITS];
+static uint32_t recent_exits_next = 0;
+
+static void record_recent_exit(pid_t pid, int status, uint64_t reaped_ns) {
+	struct stats_page_exit* e = recent_exits + (recent_exits_next % STATS_PAGE_RECENT_EXITS);
+	e->pid = pid;
+	e->status = status;
+	e->reaped_ns = reaped_ns;
+	recent_exits_next ++;
+}
+
+static void update_stats_page() {
+	struct stats_page* page = stats_page;
+	if (page == NULL) {
+		return;
+	}
+	const uint64_t sequence = page->sequence;
+	__atomic_store_n(&page->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	page->updated_ns = now_ns();
+	page->reaped = stats.reaped;
+	page->orphans_reaped = stats.orphans_reaped;
+	page->log_dropped = log_output.dropped;
+	page->peak_batch = stats.peak_batch;
+	page->shutdown_phase = (uint32_t)shutdown_phase;
+	page->shutdown_started_ns = shutdown_started_ns;
+	page->command_pid = command_pid;
+	page->command_running = command_running;
+	page->latency_count = reap_latency.count;
+	for (int i = 0; i < LATENCY_BUCKETS; i ++) {
+		page->latency_buckets[i] = reap_latency.buckets[i];
+	}
+	page->recent_exits_next = recent_exits_next % STATS_PAGE_RECENT_EXITS;
+	memcpy(page->recent_exits, recent_exits, sizeof(recent_exits));
+	__atomic_store_n(&page->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void remove_stats_page() {
+	update_stats_page(); // final state, in case a reader is looking right now
+	unlink(stats_file);
+}
+
+static void initialize_stats_page() {
+	int fd = open(stats_file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		LOGf("Failed to create %s - errno: %d (%s)", stats_file, errno, strerror(errno));
+		return;
+	}
+	const size_t size = (sizeof(struct stats_page) + 4095) & ~(size_t)4095;
+	void* p = MAP_FAILED;
+	if (ftruncate(fd, (off_t)size) == 0) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (p == MAP_FAILED) {
+		LOGf("Failed to map %s - errno: %d (%s)", stats_file, errno, strerror(errno));
+		close(fd);
+		unlink(stats_file);
+		return;
+	}
+	close(fd);
+	stats_page = (struct stats_page*) p;
+	stats_page->size = sizeof(struct stats_page);
+	stats_page->version = STATS_PAGE_VERSION;
+	stats_page->reaper_pid = getpid();
+	update_stats_page();
+	// Readers check the magic last; it is valid once everything else is.
+	__atomic_store_n(&stats_page->magic, STATS_PAGE_MAGIC, __ATOMIC_RELEASE);
+	atexit(remove_stats_page);
+	VERBOSEf("stats page: %s", stats_file);
+}
+
+////////////////// http server ////////////////////////////////////
+
+// A minimal HTTP/1.0 server for the metrics endpoint, running inside the
+// event loop: no threads, a fixed pool of connections, and responses built
+// in a static buffer. Each connection gets one response and is closed.
+// Clients get HTTP_TIMEOUT_MS to send their request; when all connections
+// are taken, the oldest one is dropped, so idle clients cannot starve probes.
+#define MAX_HTTP_CONNECTIONS 8
+#define HTTP_TIMEOUT_MS 2000
+
+// Fills body with the response for path; returns the HTTP status code.
+typedef int (*http_route_t)(const char* path, char* body, size_t size, size_t* len);
+
+struct http_listener {
+	struct event_source src;
+	http_route_t route;
+	char unix_path[108]; // removed at exit
+};
+
+struct http_connection {
+	struct event_source src; // src.fd == -1: free
+	struct http_listener* listener;
+	uint64_t accepted_ns;
+	size_t len;
+	char request[1024];
+};
+
+static struct http_connection http_connections[MAX_HTTP_CONNECTIONS];
+static int http_connections_initialized = 0;
+
+// Held open so that, when out of fds, we can still accept and drop a pending
+// connection; else the listener stays readable and the event loop spins.
+static int http_spare_fd = -1;
+
+static char http_response[32 * 1024];
+
+static void close_http_connection(struct http_connection* conn) {
+	close(conn->src.fd);
+	conn->src.fd = -1;
+}
+
+// Runs while connections are open; closes those past their deadline.
+static void handle_http_timer(struct event_source* src, uint32_t events);
+static struct event_source http_timer = { -1, handle_http_timer };
+
+static void arm_http_timer() {
+	uint64_t oldest_ns = 0;
+	for (int i = 0; i < MAX_HTTP_CONNECTIONS; i ++) {
+		if (http_connections[i].src.fd != -1 && (oldest_ns == 0 || http_connections[i].accepted_ns < oldest_ns)) {
+			oldest_ns = http_connections[i].accepted_ns;
+		}
+	}
+	if (oldest_ns == 0) {
+		arm_timer(http_timer.fd, 0);
+		return;
+	}
+	const uint64_t elapsed_ms = (now_ns() - oldest_ns) / 1000000;
+	arm_deadline(http_timer.fd, elapsed_ms < HTTP_TIMEOUT_MS ? (long)(HTTP_TIMEOUT_MS - elapsed_ms) : 0);
+}
+
+static void handle_http_timer(struct event_source* src, uint32_t events) {
+	if (read_timer(src->fd) == 0) {
+		return;
+	}
+	const uint64_t now = now_ns();
+	for (int i = 0; i < MAX_HTTP_CONNECTIONS; i ++) {
+		struct http_connection* conn = http_connections + i;
+		if (conn->src.fd != -1 && now - conn->accepted_ns >= HTTP_TIMEOUT_MS * 1000000ull) {
+			VERBOSE("http: closing idle connection");
+			close_http_connection(conn);
+		}
+	}
+	arm_http_timer();
+}
+
+static void respond_http(struct http_connection* conn, http_route_t route) {
+	// Request line: "GET /path HTTP/1.x"
+	char path[256] = "/";
+	const char* p = strchr(conn->request, ' ');
+	if (p) {
+		size_t n = strcspn(p + 1, " ?\r\n");
+		if (n < sizeof(path)) {
+			memcpy(path, p + 1, n);
+			path[n] = '\0';
+		}
+	}
+	static char body[24 * 1024];
+	size_t body_len = 0;
+	const int code = route(path, body, sizeof(body), &body_len);
+	const char* reason = code == 200 ? "OK" : (code == 404 ? "Not Found" : "Service Unavailable");
+	size_t len = format(http_response, sizeof(http_response),
+	                    "HTTP/1.0 %d %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+	                    "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+	                    code, reason, (unsigned long)body_len);
+	if (body_len > sizeof(http_response) - len) {
+		body_len = sizeof(http_response) - len;
+	}
+	memcpy(http_response + len, body, body_len);
+	len += body_len;
+	// The response fits into the socket buffer; if not, the client gets less.
+	send(conn->src.fd, http_response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close_http_connection(conn);
+}
+
+static void handle_http_connection(struct event_source* src, uint32_t events) {
+	struct http_connection* conn = (struct http_connection*) src;
+	for (;;) {
+		ssize_t bytes = recv(src->fd, conn->request + conn->len,
+		                     sizeof(conn->request) - 1 - conn->len, MSG_DONTWAIT);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes == -1 && errno == EAGAIN) {
+			return; // wait for the rest of the request
+		}
+		if (bytes <= 0) {
+			close_http_connection(conn);
+			return;
+		}
+		conn->len += (size_t)bytes;
+		conn->request[conn->len] = '\0';
+		if (strstr(conn->request, "\r\n\r\n") || strstr(conn->request, "\n\n") ||
+		    conn->len == sizeof(conn->request) - 1) {
+			respond_http(conn, conn->listener->route);
+			return;
+		}
+	}
+}
+
+static void handle_http_listener(struct event_source* src, uint32_t events) {
+	struct http_listener* listener = (struct http_listener*) src;
+	for (;;) {
+		int fd = accept4(src->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if ((errno == EMFILE || errno == ENFILE) && http_spare_fd != -1) {
+				close(http_spare_fd);
+				fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC);
+				if (fd != -1) {
+					close(fd);
+				}
+				http_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				if (fd != -1) {
+					continue;
+				}
+			}
+			break; // EAGAIN
+		}
+		// A free slot, else evict the oldest connection.
+		struct http_connection* conn = http_connections;
+		for (int i = 1; i < MAX_HTTP_CONNECTIONS && conn->src.fd != -1; i ++) {
+			if (http_connections[i].src.fd == -1 || http_connections[i].accepted_ns < conn->accepted_ns) {
+				conn = http_connections + i;
+			}
+		}
+		if (conn->src.fd != -1) {
+			VERBOSE("http: all connections busy, closing the oldest");
+			close_http_connection(conn);
+		}
+		conn->src.fd = fd;
+		conn->src.handler = handle_http_connection;
+		conn->listener = listener;
+		conn->accepted_ns = now_ns();
+		conn->len = 0;
+		if (add_event_source(&conn->src, EPOLLIN) == -1) {
+			close_http_connection(conn);
+		}
+	}
+	arm_http_timer();
+}
+
+static void remove_unix_socket(struct http_listener* listener) {
+	if (listener->unix_path[0] != '\0') {
+		unlink(listener->unix_path);
+	}
+}
+
+// Listens on "unix:<path>", "<ipv4 address>:<port>" or ":<port>" (localhost).
+static int open_http_listener(struct http_listener* listener, const char* address, http_route_t route) {
+	if (!http_connections_initialized) {
+		for (int i = 0; i < MAX_HTTP_CONNECTIONS; i ++) {
+			http_connections[i].src.fd = -1;
+		}
+		http_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		http_timer.fd = create_timer();
+		add_event_source(&http_timer, EPOLLIN);
+		http_connections_initialized = 1;
+	}
+	listener->route = route;
+	listener->src.handler = handle_http_listener;
+	int fd;
+	if (strncmp(address, "unix:", 5) == 0) {
+		struct sockaddr_un sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		if (strlen(address + 5) >= sizeof(sa.sun_path)) {
+			LOGf("Socket path too long: %s", address + 5);
+			return -1;
+		}
+		strcpy(sa.sun_path, address + 5);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		struct stat st;
+		if (stat(sa.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			unlink(sa.sun_path); // stale socket from an earlier run
+		}
+		if (fd == -1 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+			LOGf("Failed to bind %s - errno: %d (%s)", address, errno, strerror(errno));
+			return -1;
+		}
+		strcpy(listener->unix_path, sa.sun_path);
+	} else {
+		const char* colon = strrchr(address, ':');
+		char host[64] = "127.0.0.1";
+		struct sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		if (colon == NULL || (size_t)(colon - address) >= sizeof(host)) {
+			LOGf("Invalid address: %s", address);
+			return -1;
+		}
+		if (colon > address) {
+			memcpy(host, address, (size_t)(colon - address));
+			host[colon - address] = '\0';
+		}
+		char* end;
+		const long port = strtol(colon + 1, &end, 10);
+		if (*end != '\0' || port <= 0 || port > 65535 || inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+			LOGf("Invalid address: %s", address);
+			return -1;
+		}
+		sa.sin_port = htons((uint16_t)port);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		const int one = 1;
+		if (fd != -1) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		}
+		if (fd == -1 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+			LOGf("Failed to bind %s - errno: %d (%s)", address, errno, strerror(errno));
+			return -1;
+		}
+	}
+	if (listen(fd, 16) == -1) {
+		LOGf("Failed to listen on %s - errno: %d (%s)", address, errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	listener->src.fd = fd;
+	return add_event_source(&listener->src, EPOLLIN);
+}
+
+////////////////// zombie watchdog ////////////////////////////////////
+
+// --zombie-check=<n>[,<interval>]: checks every <interval> (default: 1s) how
+// many of our direct children are zombies, i.e. exited but not reaped yet, and
+// since when we see them. Normally there are none: we reap right away. If there
+// are more than <n>, something keeps us from reaping (a blocked write, a
+// starved CPU); we log what we can tell about that and reap immediately.
+static int zombie_check = 0;
+static int zombie_threshold = 0;
+static long zombie_check_ms = 1000;
+
+#define MAX_ZOMBIE_AGES 4096 // power of two
+
+// When we first saw each zombie; rebuilt on every check.
+struct zombie_age {
+	pid_t pid; // 0: free
+	uint64_t first_seen_ns;
+};
+static struct zombie_age zombie_ages[2][MAX_ZOMBIE_AGES];
+static int current_zombie_ages = 0;
+
+static uint64_t last_run_delay_ns = 0;
+static int log_was_pending = 0; // log output was not flushed at the last check
+
+static void handle_zombie_timer(struct event_source* src, uint32_t events);
+static struct event_source zombie_timer = { -1, handle_zombie_timer };
+
+static int is_zombie(pid_t pid) {
+	char path[64];
+	char buf[512];
+	format(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if (read_file(path, buf, sizeof(buf)) > 0) {
+		const char* p = strrchr(buf, ')');
+		return p && p[1] == ' ' && p[2] == 'Z';
+	}
+	return 0;
+}
+
+static struct zombie_age* zombie_age_slot(struct zombie_age* table, pid_t pid) {
+	unsigned idx = pid_hash(pid, MAX_ZOMBIE_AGES);
+	while (table[idx].pid != 0 && table[idx].pid != pid) {
+		idx = (idx + 1) % MAX_ZOMBIE_AGES;
+	}
+	return table + idx;
+}
+
+// Time we spent waiting for a CPU (runqueue delay) so far, from schedstat.
+static uint64_t run_delay_ns() {
+	char buf[128];
+	if (read_file("/proc/self/schedstat", buf, sizeof(buf)) <= 0) {
+		return 0;
+	}
+	char* p = strchr(buf, ' ');
+	return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+static void handle_zombie_timer(struct event_source* src, uint32_t events) {
+	static pid_t children[MAX_TRACKED_PROCESSES];
+	if (read_timer(src->fd) == 0) {
+		return;
+	}
+	const uint64_t now = now_ns();
+	const int n = read_children(getpid(), children, MAX_TRACKED_PROCESSES);
+	struct zombie_age* previous = zombie_ages[current_zombie_ages];
+	struct zombie_age* current = zombie_ages[1 - current_zombie_ages];
+	memset(current, 0, sizeof(zombie_ages[0]));
+	int zombies = 0;
+	uint64_t oldest_ns = now;
+	for (int i = 0; i < n; i ++) {
+		if (!is_zombie(children[i])) {
+			continue;
+		}
+		zombies ++;
+		if (zombies >= MAX_ZOMBIE_AGES) {
+			continue; // keep one slot free so lookups terminate; count only
+		}
+		const struct zombie_age* seen = zombie_age_slot(previous, children[i]);
+		struct zombie_age* slot = zombie_age_slot(current, children[i]);
+		slot->pid = children[i];
+		slot->first_seen_ns = seen->pid != 0 ? seen->first_seen_ns : now;
+		if (slot->first_seen_ns < oldest_ns) {
+			oldest_ns = slot->first_seen_ns;
+		}
+	}
+	current_zombie_ages = 1 - current_zombie_ages;
+
+	const uint64_t run_delay = run_delay_ns();
+	const uint64_t waited_ms = (run_delay - last_run_delay_ns) / 1000000;
+	last_run_delay_ns = run_delay;
+	const int log_pending_before = log_was_pending;
+	log_was_pending = log_output.len > 0;
+	if (zombies <= zombie_threshold) {
+		return;
+	}
+	const unsigned long long age_ms = (now - oldest_ns) / 1000000;
+	LOGf("Warning: %d unreaped zombies, oldest seen %llums ago", zombies, age_ms);
+	emit_event("zombies", "\"zombies\":%d,\"oldest_ms\":%llu", zombies, age_ms);
+	// What may have kept us from reaping?
+	if (log_pending_before && log_output.len > 0) {
+		LOGf("  log output stalled, %lu bytes pending", (unsigned long)log_output.len);
+	}
+	if (waited_ms > 0) {
+		LOGf("  tinyreaper waited %llums for a CPU during the last %ldms",
+		     (unsigned long long)waited_ms, zombie_check_ms);
+	}
+	if (reap_latency.count > 0) {
+		LOGf("  reap latency p99 < %lluus, max %lluus", latency_percentile(99),
+		     (unsigned long long)reap_latency.max_us);
+	}
+	const unsigned long reaped_before = stats.reaped;
+	reap_children();
+	VERBOSEf("  drained %lu zombies", stats.reaped - reaped_before);
+}
+
+static void initialize_zombie_check() {
+	last_run_delay_ns = run_delay_ns();
+	zombie_timer.fd = create_timer();
+	add_event_source(&zombie_timer, EPOLLIN);
+	arm_periodic_timer(zombie_timer.fd, zombie_check_ms);
+}
+
+////////////////// metrics ////////////////////////////////////
+
+// --metrics=<address>: Prometheus text format at /metrics.
+static const char* metrics_address = NULL;
+static struct http_listener metrics_listener;
+
+// Returns the number of direct children which are zombies, i.e. waiting to be
+// reaped by us; *total receives the number of direct children.
+static int count_zombies(int* total) {
+	static pid_t children[MAX_TRACKED_PROCESSES];
+	const int n = read_children(getpid(), children, MAX_TRACKED_PROCESSES);
+	int zombies = 0;
+	for (int i = 0; i < n; i ++) {
+		zombies += is_zombie(children[i]);
+	}
+	*total = n;
+	return zombies;
+}
+
+#define METRIC(name, type, help) "# HELP tinyreaper_" name " " help "\n# TYPE tinyreaper_" name " " type "\n"
+
+static int metrics_route(const char* path, char* body, size_t size, size_t* len) {
+	if (strcmp(path, "/metrics") != 0) {
+		*len = format(body, size, "not found\n");
+		return 404;
+	}
+	int children = 0;
+	const int zombies = count_zombies(&children);
+	// children is 0 if /proc could not be read (e.g. out of fds)
+	const int orphans = children > command_running ? children - command_running : 0;
+	const double shutdown_seconds = shutdown_in_progress ? (now_ns() - shutdown_started_ns) / 1e9 : 0.0;
+	size_t n = 0;
+	n += format(body + n, size - n,
+	            METRIC("reaped_total", "counter", "Children reaped.") "tinyreaper_reaped_total %lu\n"
+	            METRIC("reaped_per_second", "gauge", "Children reaped during the last full second.") "tinyreaper_reaped_per_second %lu\n"
+	            METRIC("orphans_reaped_total", "counter", "Adopted orphans reaped.") "tinyreaper_orphans_reaped_total %lu\n"
+	            METRIC("orphans", "gauge", "Adopted orphans currently alive or waiting to be reaped.") "tinyreaper_orphans %d\n"
+	            METRIC("zombies", "gauge", "Children waiting to be reaped.") "tinyreaper_zombies %d\n"
+	            METRIC("peak_batch_size", "gauge", "Most children reaped in one batch.") "tinyreaper_peak_batch_size %u\n"
+	            METRIC("shutdown_in_progress", "gauge", "1 while shutting down.") "tinyreaper_shutdown_in_progress %d\n"
+	            METRIC("shutdown_duration_seconds", "gauge", "Time since shutdown started.") "tinyreaper_shutdown_duration_seconds %.3f\n"
+	            METRIC("log_dropped_total", "counter", "Log messages dropped because output was backed up.") "tinyreaper_log_dropped_total %lu\n",
+	            stats.reaped, reaped_last_second(), stats.orphans_reaped, orphans, zombies, stats.peak_batch,
+	            shutdown_in_progress, shutdown_seconds, log_output.dropped);
+	n += format(body + n, size - n, METRIC("reap_latency_seconds", "histogram", "Time from child exit to reap (upper bound)."));
+	unsigned long cumulative = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i ++) {
+		cumulative += reap_latency.buckets[i];
+		n += format(body + n, size - n, "tinyreaper_reap_latency_seconds_bucket{le=\"%.6f\"} %lu\n",
+		            (double)(1ull << i) / 1e6, cumulative);
+	}
+	n += format(body + n, size - n, "tinyreaper_reap_latency_seconds_bucket{le=\"+Inf\"} %lu\n"
+	            "tinyreaper_reap_latency_seconds_sum %.6f\n"
+	            "tinyreaper_reap_latency_seconds_count %lu\n",
+	            reap_latency.count, reap_latency.sum_us / 1e6, reap_latency.count);
+	*len = n;
+	return 200;
+}
+
+static void remove_metrics_socket() {
+	remove_unix_socket(&metrics_listener);
+}
+
+static void initialize_metrics() {
+	if (open_http_listener(&metrics_listener, metrics_address, metrics_route) == -1) {
+		LOG("Note: Metrics endpoint disabled.");
+		return;
+	}
+	atexit(remove_metrics_socket);
+	VERBOSEf("metrics endpoint: %s", metrics_address);
+}
+
+////////////////// readiness ////////////////////////////////////
+
+// The command can tell us it is ready via --ready-signal or the notify socket.
+// Without either, it counts as ready once started. Readiness is reported via
+// /readyz, --ready-file and --wait-ready.
+
+// --ready-signal=<sig>: the command is ready once it sends us (its parent) sig.
+static int ready_signal = 0;
+static int command_ready = 0;
+
+// --notify: sd_notify(3) style NOTIFY_SOCKET for the command.
+static int use_notify = 0;
+static const char* notify_socket_path = NULL; // --notify-socket; default: abstract
+static long watchdog_ms = 0; // --watchdog
+
+// --ready-file=<path>: created once the command is ready, removed at exit.
+static const char* ready_file = NULL;
+
+// --wait-ready: the write end of the pipe our original parent waits on.
+static int wait_ready = 0;
+static int wait_ready_fd = -1;
+
+static int readiness_tracked() {
+	return ready_signal != 0 || use_notify;
+}
+
+static void remove_ready_file() {
+	unlink(ready_file);
+}
+
+static void set_command_ready() {
+	if (command_ready) {
+		return;
+	}
+	command_ready = 1;
+	if (readiness_tracked()) {
+		LOG("command is ready.");
+	}
+	if (ready_file != NULL) {
+		int fd = open(ready_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		static int registered = 0;
+		if (fd == -1) {
+			LOGf("Failed to create %s - errno: %d (%s)", ready_file, errno, strerror(errno));
+		} else {
+			close(fd);
+			if (!registered) {
+				atexit(remove_ready_file);
+				registered = 1;
+			}
+		}
+	}
+	if (wait_ready_fd != -1) {
+		// Our original parent exits with 0 on this.
+		while (write(wait_ready_fd, "R", 1) == -1 && errno == EINTR);
+		close(wait_ready_fd);
+		wait_ready_fd = -1;
+	}
+}
+
+// Called when the command exits and is restarted: it has to get ready again.
+static void reset_readiness() {
+	if (!command_ready || !readiness_tracked()) {
+		return;
+	}
+	command_ready = 0;
+	if (ready_file != NULL) {
+		remove_ready_file();
+	}
+}
+
+// Called when the command exits: a parent still waiting learns it never got ready.
+static void fail_readiness() {
+	if (wait_ready_fd != -1) {
+		close(wait_ready_fd); // parent reads EOF and exits with 1
+		wait_ready_fd = -1;
+	}
+}
+
+// --wait-ready: fork right away. The parent waits until the command is ready
+// (exit 0) or gone before that (exit 1); the child goes on to be the reaper.
+static void detach_until_ready() {
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		LOGf("Failed to create pipe - errno: %d (%s)", errno, strerror(errno));
+		exit(-1);
+	}
+	pid_t pid = fork();
+	if (pid == -1) {
+		LOGf("Failed to fork - errno: %d (%s)", errno, strerror(errno));
+		exit(-1);
+	}
+	if (pid > 0) {
+		close(fds[1]);
+		char c;
+		ssize_t bytes;
+		while ((bytes = read(fds[0], &c, 1)) == -1 && errno == EINTR);
+		_exit(bytes == 1 ? 0 : 1);
+	}
+	close(fds[0]);
+	wait_ready_fd = fds[1];
+}
+
+static void handle_notify(struct event_source* src, uint32_t events);
+static struct event_source notify_source = { -1, handle_notify };
+
+static void handle_watchdog_timer(struct event_source* src, uint32_t events);
+static struct event_source watchdog_timer = { -1, handle_watchdog_timer };
+
+// Is pid one of our descendants? Walks up the ppid chain.
+static int is_descendant(pid_t pid) {
+	for (int depth = 0; depth < 64 && pid > 1; depth ++) {
+		struct process_info info;
+		if (read_process_stat(pid, &info) == -1) {
+			return 0;
+		}
+		if (info.ppid == getpid()) {
+			return 1;
+		}
+		pid = info.ppid;
+	}
+	return 0;
+}
+
+static void handle_notify_message(char* msg) {
+	// Newline separated assignments, e.g. "READY=1\nSTATUS=Listening"
+	for (char* line = msg; line && *line; ) {
+		char* next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		}
+		if (strcmp(line, "READY=1") == 0) {
+			set_command_ready();
+		} else if (strncmp(line, "STATUS=", 7) == 0) {
+			VERBOSEf("command status: %s", line + 7);
+		} else if (strcmp(line, "WATCHDOG=1") == 0) {
+			if (watchdog_ms > 0) {
+				arm_timer(watchdog_timer.fd, watchdog_ms);
+			}
+		} else if (strcmp(line, "WATCHDOG=trigger") == 0) {
+			LOG("Watchdog triggered by command. Terminating.");
+			start_shutdown();
+		}
+		line = next;
+	}
+}
+
+static void handle_notify(struct event_source* src, uint32_t events) {
+	for (;;) {
+		char buf[4096];
+		union {
+			struct cmsghdr align;
+			char buf[CMSG_SPACE(sizeof(struct ucred))];
+		} control;
+		struct iovec iov = { buf, sizeof(buf) - 1 };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		ssize_t bytes = recvmsg(src->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (bytes == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return; // EAGAIN
+		}
+		buf[bytes] = '\0';
+		// Only our own tree may talk to us (the socket may be reachable by others).
+		pid_t sender = 0;
+		for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_CREDENTIALS) {
+				struct ucred cred;
+				memcpy(&cred, CMSG_DATA(c), sizeof(cred));
+				sender = cred.pid;
+			} else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+				// fd store requests; we do not keep fds
+				int* fds = (int*) CMSG_DATA(c);
+				for (size_t i = 0; i < (c->cmsg_len - CMSG_LEN(0)) / sizeof(int); i ++) {
+					close(fds[i]);
+				}
+			}
+		}
+		if (sender != command_pid && !is_descendant(sender)) {
+			VERBOSEf("Ignoring notification from %d", (int)sender);
+			continue;
+		}
+		handle_notify_message(buf);
+	}
+}
+
+static void handle_watchdog_timer(struct event_source* src, uint32_t events) {
+	if (read_timer(src->fd) > 0 && !shutdown_in_progress) {
+		LOG("Watchdog timeout. Terminating.");
+		start_shutdown();
+	}
+}
+
+// Creates the socket and exports NOTIFY_SOCKET (and WATCHDOG_USEC) for the command.
+static void initialize_notify() {
+	struct sockaddr_un sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	char name[sizeof(sa.sun_path)];
+	if (notify_socket_path != NULL) {
+		if (strlen(notify_socket_path) >= sizeof(sa.sun_path)) {
+			LOGf("Socket path too long: %s", notify_socket_path);
+			exit(-1);
+		}
+		strcpy(name, notify_socket_path);
+	} else {
+		format(name, sizeof(name), "@tinyreaper-%d", (int)getpid());
+	}
+	socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(name);
+	memcpy(sa.sun_path, name, strlen(name));
+	if (name[0] == '@') {
+		sa.sun_path[0] = '\0'; // abstract namespace
+	} else {
+		unlink(name);
+		len ++;
+	}
+	notify_source.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	const int one = 1;
+	if (notify_source.fd == -1 || bind(notify_source.fd, (struct sockaddr*)&sa, len) == -1 ||
+	    setsockopt(notify_source.fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) == -1) {
+		LOGf("Failed to create notify socket %s - errno: %d (%s)", name, errno, strerror(errno));
+		exit(-1);
+	}
+	add_event_source(&notify_source, EPOLLIN);
+	setenv("NOTIFY_SOCKET", name, 1);
+	if (watchdog_ms > 0) {
+		char usec[32];
+		format(usec, sizeof(usec), "%ld", watchdog_ms * 1000);
+		setenv("WATCHDOG_USEC", usec, 1);
+		watchdog_timer.fd = create_timer();
+		add_event_source(&watchdog_timer, EPOLLIN);
+	}
+	VERBOSEf("notify socket: %s", name);
+}
+
+static void remove_notify_socket() {
+	if (notify_socket_path != NULL && notify_socket_path[0] != '@') {
+		unlink(notify_socket_path);
+	}
+}
+
+// Called after the command has been started.
+static void start_readiness_tracking() {
+	if (!readiness_tracked()) {
+		set_command_ready();
+		return;
+	}
+	if (watchdog_ms > 0) {
+		arm_timer(watchdog_timer.fd, watchdog_ms);
+	}
+}
+
+////////////////// probes ////////////////////////////////////
+
+// --probe=<address>: liveness (/healthz) and readiness (/readyz) checks served
+// by us, so orchestrators need no exec probes (which fork a helper into the
+// container every few seconds, and leave us another child to reap).
+// Live means the command runs, readiness additionally that it is ready (see
+// readiness) and that we are not shutting down.
+static const char* probe_address = NULL;
+static struct http_listener probe_listener;
+
+static int metrics_route(const char* path, char* body, size_t size, size_t* len);
+
+static int command_alive() {
+	if (command_pidfd.fd != -1) {
+		// Readable as soon as the command exited, even if not reaped yet.
+		struct pollfd pfd = { command_pidfd.fd, POLLIN, 0 };
+		return poll(&pfd, 1, 0) == 0;
+	}
+	return command_running;
+}
+
+static int probe_route(const char* path, char* body, size_t size, size_t* len) {
+	if (strcmp(path, "/healthz") == 0 || strcmp(path, "/livez") == 0) {
+		const int alive = command_alive();
+		*len = format(body, size, alive ? "ok\n" : "command not running\n");
+		return alive ? 200 : 503;
+	}
+	if (strcmp(path, "/readyz") == 0) {
+		const char* reason = !command_alive() ? "command not running\n" :
+		                     shutdown_in_progress ? "shutting down\n" :
+		                     !command_ready ? "command not ready\n" : NULL;
+		*len = format(body, size, reason ? reason : "ok\n");
+		return reason ? 503 : 200;
+	}
+	if (metrics_address != NULL && strcmp(metrics_address, probe_address) == 0) {
+		return metrics_route(path, body, size, len);
+	}
+	*len = format(body, size, "not found\n");
+	return 404;
+}
+
+static void remove_probe_socket() {
+	remove_unix_socket(&probe_listener);
+}
+
+static void initialize_probe() {
+	if (open_http_listener(&probe_listener, probe_address, probe_route) == -1) {
+		LOG("Note: Probe endpoint disabled.");
+		return;
+	}
+	atexit(remove_probe_socket);
+	VERBOSEf("probe endpoint: %s", probe_address);
+}
+
+////////////////// output relay ////////////////////////////////////
+
+// --relay[=<size>]: the command's stdout and stderr are pipes of <size> bytes
+// (default: 1M), whose contents we move to our own stdout and stderr from the
+// event loop, via splice(2), so no byte is copied through user space. If our
+// stdout stalls, the pipe absorbs the burst; the command only blocks once it
+// is full. With --relay-tags, each line is prefixed with its stream, which
+// needs a copy through an output ring; so do targets splice cannot write to
+// without blocking us (sockets) or at all (ttys).
+static long relay_pipe_size = 0; // 0: no relay
+static int relay_tags = 0;
+
+struct relay {
+	struct event_source source;   // read end of the command's pipe
+	struct event_source writable; // our target, watched while it is stalled
+	int pipe_write_fd;            // the command's end, dup2'ed to child_fd
+	int child_fd;
+	const char* tag;
+	int use_splice;
+	int at_line_start;
+	int stalled;
+	struct output out;            // our (non-blocking) target, pending data
+};
+
+static void handle_relay_input(struct event_source* src, uint32_t events);
+static void handle_relay_writable(struct event_source* src, uint32_t events);
+
+static char relay_buffers[2][OUTPUT_BUFFER_SIZE];
+
+static struct relay relays[2] = {
+	{ { -1, handle_relay_input }, { -1, handle_relay_writable }, -1, STDOUT_FILENO, "[stdout] ",
+	  .out = { -1, 0, NULL, relay_buffers[0] } },
+	{ { -1, handle_relay_input }, { -1, handle_relay_writable }, -1, STDERR_FILENO, "[stderr] ",
+	  .out = { -1, 0, NULL, relay_buffers[1] } }
+};
+
+// While the target is stalled, we stop reading and wait for it instead.
+static void set_relay_stalled(struct relay* r, int stalled) {
+	if (r->stalled == stalled || r->writable.fd == -1) {
+		return;
+	}
+	r->stalled = stalled;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = stalled ? 0 : EPOLLIN;
+	ev.data.ptr = &r->source;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, r->source.fd, &ev);
+	ev.events = EPOLLOUT;
+	ev.data.ptr = &r->writable;
+	epoll_ctl(epoll_fd, stalled ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, r->writable.fd, &ev);
+}
+
+static void close_relay(struct relay* r) {
+	set_relay_stalled(r, 0);
+	close(r->source.fd); // also removes it from epoll
+	r->source.fd = -1;
+}
+
+// Appends data to the ring, tagging line starts.
+static void relay_append(struct relay* r, const char* data, size_t len) {
+	while (len > 0) {
+		if (relay_tags && r->at_line_start) {
+			output_append(&r->out, r->tag, strlen(r->tag));
+		}
+		const char* nl = memchr(data, '\n', len);
+		const size_t line = nl ? (size_t)(nl - data) + 1 : len;
+		output_append(&r->out, data, line);
+		r->at_line_start = (nl != NULL);
+		data += line;
+		len -= line;
+	}
+}
+
+// Moves what is available; returns 1 if the target is stalled.
+static int relay_copy(struct relay* r) {
+	char buf[16 * 1024];
+	for (;;) {
+		if (output_flush(&r->out)) {
+			return 1;
+		}
+		if (r->out.broken) {
+			// Nobody reads anymore; writers get EPIPE, as they would without us.
+			VERBOSEf("fd %d is gone, closing its relay", r->child_fd);
+			close_relay(r);
+			return 0;
+		}
+		// Leave room for the worst case: a tag for every byte.
+		size_t room = (OUTPUT_BUFFER_SIZE - r->out.len) / (relay_tags ? 1 + strlen(r->tag) : 1);
+		if (room > sizeof(buf)) {
+			room = sizeof(buf);
+		}
+		ssize_t bytes = read(r->source.fd, buf, room);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes == 0) {
+			close_relay(r); // all writers are gone
+			return 0;
+		}
+		if (bytes == -1) {
+			return 0; // EAGAIN: nothing left
+		}
+		relay_append(r, buf, (size_t)bytes);
+	}
+}
+
+static int relay_splice(struct relay* r) {
+	for (;;) {
+		ssize_t bytes = splice(r->source.fd, NULL, r->out.fd, NULL, (size_t)relay_pipe_size,
+		                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (bytes > 0) {
+			continue;
+		}
+		if (bytes == 0) {
+			close_relay(r);
+			return 0;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN) {
+			// Either side may be the reason.
+			int pending = 0;
+			return ioctl(r->source.fd, FIONREAD, &pending) == 0 && pending > 0;
+		}
+		if (errno == EPIPE) {
+			VERBOSEf("fd %d is gone, closing its relay", r->child_fd);
+			close_relay(r);
+			return 0;
+		}
+		VERBOSEf("splice to fd %d failed - errno: %d (%s), copying instead", r->child_fd, errno, strerror(errno));
+		r->use_splice = 0;
+		return relay_copy(r);
+	}
+}
+
+static void run_relay(struct relay* r) {
+	if (r->source.fd == -1) {
+		return;
+	}
+	set_relay_stalled(r, r->use_splice ? relay_splice(r) : relay_copy(r));
+}
+
+static void handle_relay_input(struct event_source* src, uint32_t events) {
+	run_relay((struct relay*)((char*)src - offsetof(struct relay, source)));
+}
+
+static void handle_relay_writable(struct event_source* src, uint32_t events) {
+	run_relay((struct relay*)((char*)src - offsetof(struct relay, writable)));
+}
+
+// At exit: relay what is left, but do not hang; orphans might still write.
+static void drain_relays() {
+	const uint64_t deadline_ns = now_ns() + 3000 * 1000000ull;
+	for (int i = 0; i < 2; i ++) {
+		struct relay* r = &relays[i];
+		while (r->source.fd != -1 && now_ns() < deadline_ns) {
+			run_relay(r);
+			int pending = 0;
+			if (!r->stalled && r->out.len == 0 &&
+			    (r->source.fd == -1 || (ioctl(r->source.fd, FIONREAD, &pending) == 0 && pending == 0))) {
+				break;
+			}
+			struct pollfd pfd = { r->out.fd, POLLOUT, 0 };
+			poll(&pfd, 1, 100);
+		}
+	}
+}
+
+static void initialize_relay() {
+	for (int i = 0; i < 2; i ++) {
+		struct relay* r = &relays[i];
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) == -1) {
+			LOGf("Failed to create pipe - errno: %d (%s)", errno, strerror(errno));
+			exit(-1);
+		}
+		if (fcntl(fds[0], F_SETPIPE_SZ, (int)relay_pipe_size) == -1) {
+			LOGf("Failed to set pipe size to %ld - errno: %d (%s)", relay_pipe_size, errno, strerror(errno));
+		}
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		r->source.fd = fds[0];
+		r->pipe_write_fd = fds[1];
+		r->at_line_start = 1;
+		output_open(&r->out, r->child_fd);
+		r->use_splice = !relay_tags && !r->out.is_socket;
+		// Regular files cannot be polled, but never stall either.
+		struct stat st;
+		r->writable.fd = (fstat(r->out.fd, &st) == 0 && !S_ISREG(st.st_mode)) ? r->out.fd : -1;
+		add_event_source(&r->source, EPOLLIN);
+	}
+	atexit(drain_relays);
+}
+
+// Once no more commands get started, we drop our copies of their ends, so the
+// pipes reach EOF when the last writer (the command or an orphan) is gone.
+static void close_relay_write_ends() {
+	for (int i = 0; i < 2; i ++) {
+		if (relays[i].pipe_write_fd != -1) {
+			close(relays[i].pipe_write_fd);
+			relays[i].pipe_write_fd = -1;
+		}
+	}
+}
+
+// In the (vforked) child.
+static int redirect_to_relay() {
+	for (int i = 0; i < 2; i ++) {
+		if (dup2(relays[i].pipe_write_fd, relays[i].child_fd) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+////////////////// signal handling ////////////////////////////////////
+
+// Signals we handle. They are blocked and consumed synchronously via signalfd.
+static const int handled_signals[] = { SIGCHLD, SIGTERM, SIGINT, SIGQUIT, SIGUSR1, -1 };
+
+// The signal mask we started with; restored in the child before exec.
+static sigset_t original_sigmask;
+
+// --forward=<sig>[:<newsig>][@command|tree|cgroup]: signals we pass on
+// instead of handling them ourselves, optionally as another signal. They go
+// to the running commands (the default; via pidfd if we have one, else by pid,
+// which is just as safe for our unreaped children), to all our descendants,
+// or to the command cgroup. Nothing is broadcast to the process group, so
+// only the target wakes up. By default, HUP, WINCH and USR2 go to the commands.
+enum forward_target { FORWARD_NONE, FORWARD_COMMAND, FORWARD_TREE, FORWARD_CGROUP };
+
+static struct {
+	enum forward_target target;
+	int to_sig;
+} forwards[NSIG];
+
+static const int default_forwards[] = { SIGHUP, SIGWINCH, SIGUSR2, -1 };
+
+static const char* forward_target_name(enum forward_target target) {
+	return target == FORWARD_TREE ? "tree" : target == FORWARD_CGROUP ? "cgroup" : "command";
+}
+
+// Returns 1 if sig is forwarded (and forwards it). sender and code are
+// ssi_pid and ssi_code.
+static int forward_signal(int sig, pid_t sender, int code) {
+	if (sig <= 0 || sig >= NSIG || forwards[sig].target == FORWARD_NONE) {
+		return 0;
+	}
+	if (sender == getpid()) {
+		// E.g. SIGPIPE for our own write to a closed pipe: not meant for them.
+		VERBOSEf("Not forwarding signal %d sent by myself", sig);
+		return 1;
+	}
+	// The kernel sends terminal signals like HUP and WINCH to the whole
+	// foreground process group; who is in ours got it already. (kill() from
+	// outside our pid namespace, e.g. docker kill, also shows sender 0, but
+	// as SI_USER, and reaches only us.)
+	const pid_t skip_pgrp = sender == 0 && code == SI_KERNEL ? getpgrp() : 0;
+	if (skip_pgrp != 0) {
+		VERBOSEf("Signal %d came from the kernel, not forwarding it to process group %d", sig, (int)skip_pgrp);
+	}
+	const int to_sig = forwards[sig].to_sig;
+	VERBOSEf("Forwarding signal %d as %d to %s", sig, to_sig, forward_target_name(forwards[sig].target));
+	switch (forwards[sig].target) {
+		case FORWARD_TREE:
+			signal_descendants(to_sig, skip_pgrp);
+			break;
+		case FORWARD_CGROUP:
+			if (use_cgroup) {
+				signal_cgroup(to_sig, skip_pgrp);
+			} else {
+				signal_descendants(to_sig, skip_pgrp); // the cgroup could not be set up
+			}
+			break;
+		default:
+			for (int i = 0; i < num_commands; i ++) {
+				if (!commands[i].running) {
+					continue;
+				}
+				if (skip_pgrp != 0 && getpgid(commands[i].pid) == skip_pgrp) {
+					continue;
+				}
+				if (commands[i].pidfd.fd != -1) {
+					sys_pidfd_send_signal(commands[i].pidfd.fd, to_sig);
+				} else {
+					kill(commands[i].pid, to_sig);
+				}
+			}
+			break;
+	}
+	return 1;
+}
+
+static void initialize_forwards() {
+	for (int i = 0; default_forwards[i] != -1; i ++) {
+		const int sig = default_forwards[i];
+		if (forwards[sig].target == FORWARD_NONE && sig != ready_signal) {
+			forwards[sig].target = FORWARD_COMMAND;
+			forwards[sig].to_sig = sig;
+		}
+	}
+	for (int sig = 1; sig < NSIG; sig ++) {
+		if (forwards[sig].target == FORWARD_CGROUP && !use_cgroup) {
+			LOGf("Note: --forward of signal %d to the cgroup needs --cgroup, forwarding to the tree.", sig);
+			forwards[sig].target = FORWARD_TREE;
+		}
+	}
+}
+
+static void handle_signals(struct event_source* src, uint32_t events);
+static struct event_source signal_source = { -1, handle_signals };
+
+static void handle_signals(struct event_source* src, uint32_t events) {
+	// Drain everything pending. SIGCHLD may be coalesced arbitrarily, so we
+	// only note it and reap once after the queue is empty.
+	int need_reap = 0;
+	struct signalfd_siginfo infos[16];
+	for (;;) {
+		ssize_t bytes = read(src->fd, infos, sizeof(infos));
+		if (bytes <= 0) {
+			if (bytes == -1 && errno == EINTR) {
+				continue;
+			}
+			break; // EAGAIN: queue empty
+		}
+		int n = (int)(bytes / sizeof(infos[0]));
+		for (int i = 0; i < n; i ++) {
+			const int sig = (int)infos[i].ssi_signo;
+			TRACE2(signal, sig, (pid_t)infos[i].ssi_pid);
+
+			// Ignore SIGTERM send by myself to myself (see send_signal_to_all_children)
+			if (sig == SIGTERM && (pid_t)infos[i].ssi_pid == getpid()) {
+				VERBOSE("Ignoring SIGTERM sent by myself.");
+				continue;
+			}
+
+			if (sig == SIGCHLD) {
+				need_reap = 1;
+				continue;
+			}
+
+			VERBOSEf("Signal: %d", sig);
+			emit_signal_event(sig, (pid_t)infos[i].ssi_pid);
+
+			if (sig == ready_signal) {
+				// Like notifications, only from the command or below.
+				const pid_t sender = (pid_t)infos[i].ssi_pid;
+				if (sender == command_pid || is_descendant(sender)) {
+					set_command_ready();
+				} else {
+					VERBOSEf("Ignoring ready signal from %d", (int)sender);
+				}
+				continue;
+			}
+
+			if (forward_signal(sig, (pid_t)infos[i].ssi_pid, infos[i].ssi_code)) {
+				continue;
+			}
+
+			switch (sig) {
+				case SIGTERM:
+				case SIGINT:
+				case SIGQUIT:
+					start_shutdown();
+					break;
+				case SIGUSR1:
+					log_reports();
+					break;
+			}
+		}
+	}
+	if (need_reap) {
+		reap_children();
+	}
+}
+
+static void initialize_signal_handling() {
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (int i = 0; handled_signals[i] != -1; i ++) {
+		sigaddset(&mask, handled_signals[i]);
+	}
+	if (ready_signal != 0) {
+		sigaddset(&mask, ready_signal);
+	}
+	initialize_forwards();
+	for (int sig = 1; sig < NSIG; sig ++) {
+		if (forwards[sig].target != FORWARD_NONE) {
+			sigaddset(&mask, sig);
+		}
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, &original_sigmask) == -1) {
+		LOGf("Failed to block signals - errno: %d (%s)", errno, strerror(errno));
+		exit(-1);
+	}
+	signal_source.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_source.fd == -1) {
+		LOGf("Failed to create signalfd - errno: %d (%s)", errno, strerror(errno));
+		exit(-1);
+	}
+	add_event_source(&signal_source, EPOLLIN);
+}
+
+////////////////// misc stuff ////////////////////////////////////
+
+// Make process a sub reaper for all direct and indirect children
+static void make_me_a_reaper() {
+	int rc = prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+	if (rc == -1) {
+		LOGf("Failed to set sub reaper state - errno: %d (%s)", errno, strerror(errno));
+		LOG("Note: Will not adopt orphans.");
+	}
+}
+
+// Known signal names, with or without "SIG" prefix, or numbers.
+static int parse_signal(const char* name) {
+	static const struct { const char* name; int sig; } signals[] = {
+		{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+		{ "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+		{ "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+		{ "TTIN", SIGTTIN }, { "TTOU", SIGTTOU }, { "WINCH", SIGWINCH }, { "PWR", SIGPWR },
+		{ NULL, 0 }
+	};
+	if (name[0] >= '0' && name[0] <= '9') {
+		char* end;
+		long sig = strtol(name, &end, 10);
+		return (*end == '\0' && sig > 0 && sig < NSIG) ? (int)sig : -1;
+	}
+	if (strncmp(name, "SIG", 3) == 0) {
+		name += 3;
+	}
+	for (int i = 0; signals[i].name != NULL; i ++) {
+		if (strcmp(name, signals[i].name) == 0) {
+			return signals[i].sig;
+		}
+	}
+	return -1;
+}
+
+// <sig>[:<newsig>][@command|tree|cgroup], see --forward.
+static int parse_forward(const char* value) {
+	char buf[64];
+	if (format(buf, sizeof(buf), "%s", value) >= sizeof(buf) - 1) {
+		return -1;
+	}
+	enum forward_target target = FORWARD_COMMAND;
+	char* at = strchr(buf, '@');
+	if (at != NULL) {
+		*at ++ = '\0';
+		if (strcmp(at, "command") == 0) {
+			target = FORWARD_COMMAND;
+		} else if (strcmp(at, "tree") == 0) {
+			target = FORWARD_TREE;
+		} else if (strcmp(at, "cgroup") == 0) {
+			target = FORWARD_CGROUP;
+		} else {
+			return -1;
+		}
+	}
+	char* colon = strchr(buf, ':');
+	if (colon != NULL) {
+		*colon ++ = '\0';
+	}
+	const int sig = parse_signal(buf);
+	const int to_sig = colon != NULL ? parse_signal(colon) : sig;
+	// We cannot catch KILL and STOP, and we need CHLD ourselves.
+	if (sig <= 0 || to_sig <= 0 || sig == SIGKILL || sig == SIGSTOP || sig == SIGCHLD) {
+		return -1;
+	}
+	forwards[sig].target = target;
+	forwards[sig].to_sig = to_sig;
+	return 0;
+}
+
+////////////////// scheduling ////////////////////////////////////
+
+// Where and how we run (--reaper-cpus, --reaper-sched, --reaper-nice), so that
+// reaping orphan storms does not compete with latency sensitive workers, and
+// separately where and how the command runs (--cpus, --sched, --nice, --numa).
+// The command inherits our settings, so unless it has its own, the child puts
+// back what we had before we changed ours.
+struct sched_settings {
+	int has_cpus;
+	cpu_set_t cpus;
+	int has_policy;
+	int policy;
+	int priority; // SCHED_FIFO/SCHED_RR only
+	int has_nice;
+	int nice;
+};
+
+static struct sched_settings reaper_sched;
+static struct sched_settings command_sched;
+static struct sched_settings original_sched; // ours, at startup
+
+// --numa=local|preferred:<node>|bind:<nodes>|interleave:<nodes> (command only)
+static int numa_mode = -1;
+static unsigned long numa_nodes[1024 / (8 * sizeof(unsigned long))];
+
+// "0-3,8,10-11" -> bits. Returns -1 if malformed or out of range.
+static int parse_cpu_list(const char* s, unsigned long* bits, int max) {
+	memset(bits, 0, (size_t)max / 8);
+	const int word = 8 * sizeof(unsigned long);
+	while (*s != '\0') {
+		char* end;
+		long first = strtol(s, &end, 10);
+		long last = first;
+		if (end == s) {
+			return -1;
+		}
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s) {
+				return -1;
+			}
+		}
+		if (first < 0 || last < first || last >= max) {
+			return -1;
+		}
+		for (long i = first; i <= last; i ++) {
+			bits[i / word] |= 1ul << (i % word);
+		}
+		if (*end == ',') {
+			end ++;
+		} else if (*end != '\0') {
+			return -1;
+		}
+		s = end;
+	}
+	return 0;
+}
+
+static int parse_cpus(const char* s, struct sched_settings* settings) {
+	CPU_ZERO(&settings->cpus);
+	if (parse_cpu_list(s, (unsigned long*)&settings->cpus, CPU_SETSIZE) == -1 ||
+	    CPU_COUNT(&settings->cpus) == 0) {
+		return -1;
+	}
+	settings->has_cpus = 1;
+	return 0;
+}
+
+// other|batch|idle|fifo:<priority>|rr:<priority>
+static int parse_sched(const char* s, struct sched_settings* settings) {
+	static const struct { const char* name; int policy; } policies[] = {
+		{ "other", SCHED_OTHER }, { "batch", SCHED_BATCH }, { "idle", SCHED_IDLE },
+		{ "fifo", SCHED_FIFO }, { "rr", SCHED_RR }, { NULL, 0 }
+	};
+	const char* colon = strchr(s, ':');
+	const size_t len = colon ? (size_t)(colon - s) : strlen(s);
+	for (int i = 0; policies[i].name != NULL; i ++) {
+		if (strlen(policies[i].name) != len || strncmp(s, policies[i].name, len) != 0) {
+			continue;
+		}
+		const int policy = policies[i].policy;
+		const int realtime = (policy == SCHED_FIFO || policy == SCHED_RR);
+		settings->priority = 0;
+		if (realtime != (colon != NULL)) {
+			return -1; // realtime policies need a priority, the others take none
+		}
+		if (realtime) {
+			char* end;
+			settings->priority = (int)strtol(colon + 1, &end, 10);
+			if (*end != '\0' || settings->priority < sched_get_priority_min(policy) ||
+			    settings->priority > sched_get_priority_max(policy)) {
+				return -1;
+			}
+		}
+		settings->policy = policy;
+		settings->has_policy = 1;
+		return 0;
+	}
+	return -1;
+}
+
+static int parse_nice(const char* s, struct sched_settings* settings) {
+	char* end;
+	settings->nice = (int)strtol(s, &end, 10);
+	settings->has_nice = 1;
+	return (*end == '\0' && settings->nice >= -20 && settings->nice <= 19) ? 0 : -1;
+}
+
+static int parse_numa(const char* s) {
+	static const struct { const char* name; int mode; } modes[] = {
+		{ "preferred:", MPOL_PREFERRED }, { "bind:", MPOL_BIND },
+		{ "interleave:", MPOL_INTERLEAVE }, { NULL, 0 }
+	};
+	if (strcmp(s, "local") == 0) {
+		numa_mode = MPOL_LOCAL;
+		return 0;
+	}
+	for (int i = 0; modes[i].name != NULL; i ++) {
+		const size_t len = strlen(modes[i].name);
+		if (strncmp(s, modes[i].name, len) == 0) {
+			numa_mode = modes[i].mode;
+			return parse_cpu_list(s + len, numa_nodes, 8 * sizeof(numa_nodes));
+		}
+	}
+	return -1;
+}
+
+// Applies settings to the calling process; returns the failing step, or NULL.
+// Async-signal-safe, as it runs in the vforked child too.
+static const char* apply_sched_settings(const struct sched_settings* settings) {
+	if (settings->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &settings->cpus) == -1) {
+		return "set CPU affinity";
+	}
+	if (settings->has_policy) {
+		struct sched_param param = { settings->priority };
+		if (sched_setscheduler(0, settings->policy, &param) == -1) {
+			return "set scheduling policy";
+		}
+	}
+	if (settings->has_nice && setpriority(PRIO_PROCESS, 0, settings->nice) == -1) {
+		return "set nice value";
+	}
+	return NULL;
+}
+
+// Remembers our original settings, then applies --reaper-*.
+static void initialize_scheduling() {
+	original_sched.has_cpus = sched_getaffinity(0, sizeof(cpu_set_t), &original_sched.cpus) == 0;
+	struct sched_param param;
+	original_sched.policy = sched_getscheduler(0);
+	original_sched.has_policy = original_sched.policy != -1 && sched_getparam(0, &param) == 0;
+	original_sched.priority = param.sched_priority;
+	errno = 0;
+	original_sched.nice = getpriority(PRIO_PROCESS, 0);
+	original_sched.has_nice = (errno == 0);
 
-static pid_t command_pid = -1;
+	const char* failed = apply_sched_settings(&reaper_sched);
+	if (failed != NULL) {
+		LOGf("Failed to %s - errno: %d (%s)", failed, errno, strerror(errno));
+		exit(-1);
+	}
+}
 
-////////////////// logging        ////////////////////////////////////
+// What the child restores before applying the command's own settings: the
+// original ones where we changed ours and the command has none.
+static void restored_sched_settings(struct sched_settings* settings) {
+	memset(settings, 0, sizeof(*settings));
+	if (reaper_sched.has_cpus && !command_sched.has_cpus) {
+		settings->has_cpus = original_sched.has_cpus;
+		settings->cpus = original_sched.cpus;
+	}
+	if (reaper_sched.has_policy && !command_sched.has_policy) {
+		settings->has_policy = original_sched.has_policy;
+		settings->policy = original_sched.policy;
+		settings->priority = original_sched.priority;
+	}
+	if (reaper_sched.has_nice && !command_sched.has_nice) {
+		settings->has_nice = original_sched.has_nice;
+		settings->nice = original_sched.nice;
+	}
+}
 
-// Note: LOG is signal safe, LOGf is not.
-#define WRITE_LITERAL_STRING(s) 	{ write(STDOUT_FILENO, s, sizeof(s)); } 
-#define LOG(msg)  					WRITE_LITERAL_STRING("tinyreaper: " msg "\n")
+// Restoring is best effort, e.g. unprivileged processes cannot lower their
+// nice value again. The child leaves what failed here, for the parent to log.
+static const char* volatile restore_failed_step = NULL;
+static volatile int restore_errno = 0;
 
-static void LOGf(const char* fmt, ...) {
-	WRITE_LITERAL_STRING("tinyreaper: ");
-	va_list ap;
-	va_start(ap, fmt);
-	vprintf(fmt, ap);
-	va_end(ap);
-	printf("\n");
-	fflush(stdout);
+// In the child: returns the failing step, or NULL.
+static const char* apply_command_scheduling(const struct sched_settings* restored) {
+	const char* restore_failed = apply_sched_settings(restored);
+	if (restore_failed != NULL) {
+		restore_errno = errno;
+		restore_failed_step = restore_failed;
+	}
+	const char* failed = apply_sched_settings(&command_sched);
+	if (failed == NULL && numa_mode != -1 &&
+	    syscall(__NR_set_mempolicy, numa_mode, numa_mode == MPOL_LOCAL ? NULL : numa_nodes,
+	            numa_mode == MPOL_LOCAL ? 0 : 8 * sizeof(numa_nodes) + 1) == -1) {
+		failed = "set NUMA policy";
+	}
+	return failed;
 }
 
-#define VERBOSEf(fmt, ...) 	if (verbose) { LOGf(fmt, __VA_ARGS__); }
-#define VERBOSE(msg) 		if (verbose) { LOG(msg); }
+////////////////// command launch ////////////////////////////////////
 
-static void print_usage() {
-	printf("tinyreaper [Options] <command> [<command arguments>]\n");
-	printf("\n");
-	printf("Registers itself as sub reaper for child processes, then starts <command>.\n");
-	printf("\n");
-	printf("Options:\n");
-    printf("`-v`: verbose mode\n");
-	printf("`-V`: version\n");
-	printf("`-h`: this help\n");
-}
+// The command is started via vfork: the child borrows our address space until
+// it execs, so no page tables get copied, and we learn synchronously whether
+// exec worked. The child must not touch our state: it only restores the
+// signal mask, joins the cgroup, and execs. What went wrong is passed back
+// through shared memory. posix_spawn would do the same, but cannot join a
+// cgroup before exec.
+static volatile int launch_errno = 0;
+static const char* volatile launch_step = NULL;
 
-// Signal safe writing of a decimal number
-static void write_num(unsigned n) {
-	int a = n;
-	if (n > 9) {
-		write_num(n/10);
+// Our exit code if a command could not be started.
+static int launch_exit_code = 0;
+
+// Exit codes for a command which could not be started, following the shell.
+#define EXIT_NOT_FOUND		127
+#define EXIT_NOT_EXECUTABLE	126
+
+// A standby (see there) is started via fork, since it does not exec right
+// away (barrier) or needs its environment changed (exec); it cannot report
+// through shared memory, so launch failures show as its exit status.
+enum standby_mode {
+	STANDBY_NO,
+	STANDBY_BARRIER, // waits before exec until released via standby_barrier
+	STANDBY_EXEC     // exec'd with TINYREAPER_STANDBY=<go signal>, released by that signal
+};
+static enum standby_mode standby_mode = STANDBY_NO;
+static int standby_go_signal = SIGCONT;
+static int standby_barrier[2] = { -1, -1 };
+
+// execvp-style lookup: names without a slash are searched in $PATH. Returns 0
+// and the full path in <path>, or -1 with errno set.
+static int resolve_command(const char* name, char* path, size_t size) {
+	if (strchr(name, '/') != NULL) {
+		if (strlen(name) >= size) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(path, name);
+		return 0;
 	}
-	const char* const digits = "0123456789";
-	write(STDOUT_FILENO, digits + (a % 10), 1);
+	const char* search = getenv("PATH");
+	if (search == NULL) {
+		search = "/usr/local/bin:/usr/bin:/bin";
+	}
+	int err = ENOENT;
+	const size_t name_len = strlen(name);
+	while (*search != '\0') {
+		const char* end = strchrnul(search, ':');
+		size_t dir_len = (size_t)(end - search);
+		// an empty entry means the current directory
+		const char* dir = dir_len > 0 ? search : ".";
+		if (dir_len == 0) {
+			dir_len = 1;
+		}
+		if (dir_len + 1 + name_len < size) {
+			memcpy(path, dir, dir_len);
+			path[dir_len] = '/';
+			memcpy(path + dir_len + 1, name, name_len + 1);
+			struct stat st;
+			if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+				if (access(path, X_OK) == 0) {
+					return 0;
+				}
+				err = EACCES; // remember, but keep looking like execvp does
+			}
+		}
+		search = (*end == ':') ? end + 1 : end;
+	}
+	errno = err;
+	return -1;
 }
 
-// Signal safe logging of process exit status
-static void LOG_process_state(pid_t pid, int status) {
-	if (pid > 0) {
-		if (WIFEXITED(status)) {
-			WRITE_LITERAL_STRING("child ");
-			write_num((unsigned)pid);
-			WRITE_LITERAL_STRING(" exited with ");
-			write_num((unsigned)WEXITSTATUS(status));
-			WRITE_LITERAL_STRING("\n");
-		} else if (WIFSIGNALED(status)) {
-			WRITE_LITERAL_STRING("child ");
-			write_num((unsigned)pid);
-			WRITE_LITERAL_STRING(" terminated with ");
-			write_num((unsigned)WTERMSIG(status));
-			WRITE_LITERAL_STRING("\n");
+// In the standby child: blocks until released (1 byte) or discarded (EOF).
+static int standby_wait() {
+	char go;
+	close(standby_barrier[1]);
+	ssize_t n;
+	while ((n = read(standby_barrier[0], &go, 1)) == -1 && errno == EINTR);
+	close(standby_barrier[0]);
+	return n == 1 ? 0 : -1;
+}
+
+// Starts <argv> and returns its pid, or -1 if it cannot be started. A standby
+// is started according to standby_mode.
+static pid_t launch_command(char** argv, int standby) {
+	char path[PATH_MAX];
+	launch_exit_code = 0;
+	if (resolve_command(argv[0], path, sizeof(path)) == -1) {
+		if (errno == ENOENT) {
+			LOGf("Command not found: %s", argv[0]);
+		} else {
+			LOGf("Cannot execute \"%s\" - errno: %d (%s)", argv[0], errno, strerror(errno));
+		}
+		launch_exit_code = (errno == ENOENT) ? EXIT_NOT_FOUND : EXIT_NOT_EXECUTABLE;
+		return -1;
+	}
+	char procs_path[PATH_MAX];
+	if (use_cgroup) {
+		cgroup_file(procs_path, sizeof(procs_path), "cgroup.procs");
+	}
+	struct sched_settings restored;
+	restored_sched_settings(&restored);
+	VERBOSEf("starting %s%s", standby ? "standby " : "", path);
+
+	pid_t pid = standby ? fork() : vfork();
+	if (pid == 0) {
+		// --- Child: only async-signal-safe calls, no writes except launch_* ---
+		sigprocmask(SIG_SETMASK, &original_sigmask, NULL);
+		signal(SIGPIPE, SIG_DFL);
+		const char* failed;
+		if (use_cgroup && join_command_cgroup(procs_path) == -1) {
+			launch_step = "join cgroup";
+		} else if (relay_pipe_size > 0 && redirect_to_relay() == -1) {
+			launch_step = "redirect output";
+		} else if (pids_max_via_rlimit && set_nproc_limit() == -1) {
+			launch_step = "set RLIMIT_NPROC";
+		} else if ((failed = apply_command_scheduling(&restored)) != NULL) {
+			launch_step = failed;
+		} else if (standby && standby_mode == STANDBY_BARRIER && standby_wait() == -1) {
+			_exit(0); // not needed after all
+		} else {
+			if (standby && standby_mode == STANDBY_EXEC) {
+				char go[16];
+				format(go, sizeof(go), "%d", standby_go_signal);
+				setenv("TINYREAPER_STANDBY", go, 1); // we are a fork, the heap is ours
+			}
+			TRACE1(exec, path);
+			execv(path, argv);
+			launch_step = "exec";
 		}
+		launch_errno = errno;
+		_exit(EXIT_NOT_FOUND);
+	}
+	if (pid == -1) {
+		LOGf("Failed to start command - errno: %d (%s)", errno, strerror(errno));
+		launch_exit_code = -1;
+		return -1;
 	}
+	if (restore_failed_step != NULL) {
+		LOGf("Failed to %s back to our original settings for \"%s\" - errno: %d (%s)",
+		     restore_failed_step, path, restore_errno, strerror(restore_errno));
+		restore_failed_step = NULL;
+	}
+	if (launch_step != NULL) {
+		// The child has exited already; reap it here, so it does not pass
+		// for an adopted orphan.
+		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
+		LOGf("Failed to %s %s\"%s\" - errno: %d (%s)", launch_step,
+		     strcmp(launch_step, "exec") == 0 ? "" : "for ", path,
+		     launch_errno, strerror(launch_errno));
+		launch_step = NULL;
+		launch_exit_code = (launch_errno == ENOENT) ? EXIT_NOT_FOUND : EXIT_NOT_EXECUTABLE;
+		return -1;
+	}
+	TRACE2(spawn, pid, path);
+	emit_spawn_event(pid, path);
+	return pid;
 }
 
+////////////////// restart ////////////////////////////////////
 
-////////////////// Child handling ////////////////////////////////////
+// --restart=on-failure|always: instead of shutting down, a command which exited
+// is started again after a delay, which doubles with every restart (up to a
+// maximum) and is jittered, so that a crash looping command does not hog the
+// machine and several of them do not restart in lockstep. A command which ran
+// longer than the maximum delay starts over with the initial delay.
+enum restart_policy {
+	RESTART_NO,
+	RESTART_ON_FAILURE,
+	RESTART_ALWAYS
+};
+static enum restart_policy restart_policy = RESTART_NO;
+static int max_restarts = -1; // --max-restarts; default: unlimited
+static long restart_delay_ms = 100; // --restart-delay=<time>[,<max>]
+static long max_restart_delay_ms = 10000;
 
-static void send_signal_to_all_children(int sig) {
-	// We send a signal to the process group, which includes ourselves.
-	// We filter out signals from ourselves in the signal handler.
-	if (getpgrp() == getpid()) { // sanity check, am I really process group leader?
-		kill(0, sig);
+// --restart-orphans=keep|terminate: what happens to processes the command left
+// behind. By default, they are reaped whenever they exit.
+static int terminate_orphans_on_restart = 0;
+
+static void handle_restart_timer(struct event_source* src, uint32_t events);
+
+// see standby
+static pid_t promote_standby(long prespawn_delay_ms);
+static long standby_prespawn_ms = 0;
+
+// Sends SIGTERM to all descendants which do not belong to a running command.
+static void terminate_orphans() {
+	static pid_t pids[MAX_TRACKED_PROCESSES];
+	const int n = collect_descendants(pids, sizeof(pids) / sizeof(pids[0]));
+	const pid_t self = getpid();
+	int terminated = 0;
+	for (int i = 0; i < n; i ++) {
+		// Find the ancestor which is our direct child.
+		pid_t top = pids[i];
+		struct process_info* info;
+		while ((info = find_process(top)) != NULL && info->ppid != self) {
+			top = info->ppid;
+		}
+		struct command* cmd = find_command(top);
+		if (info != NULL && (cmd == NULL || !cmd->running) && !is_standby(top)) {
+			kill(pids[i], SIGTERM);
+			terminated ++;
+		}
+	}
+	if (terminated > 0) {
+		VERBOSEf("Terminated %d orphans.", terminated);
 	}
 }
 
-////////////////// signal handling ////////////////////////////////////
+// A cheap xorshift is good enough to spread restarts.
+static unsigned long restart_jitter(unsigned long range) {
+	static uint64_t state = 0;
+	if (state == 0) {
+		state = now_ns() ^ ((uint64_t)getpid() << 32) ^ 1;
+	}
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return range > 0 ? (unsigned long)(state % range) : 0;
+}
+
+// Called when cmd exited; returns 1 if it will be started again.
+static int schedule_restart(struct command* cmd) {
+	if (restart_policy == RESTART_NO || shutdown_in_progress) {
+		return 0;
+	}
+	const int succeeded = WIFEXITED(cmd->status) && WEXITSTATUS(cmd->status) == 0;
+	if (restart_policy == RESTART_ON_FAILURE && succeeded) {
+		return 0;
+	}
+	if (max_restarts >= 0 && cmd->restarts >= max_restarts) {
+		LOGf("%s: giving up after %d restarts.", cmd->argv[0], cmd->restarts);
+		return 0;
+	}
+	if (now_ns() - cmd->started_ns >= (uint64_t)max_restart_delay_ms * 1000000ull) {
+		cmd->backoff = 0; // it ran fine for a while
+	}
+	long delay = restart_delay_ms;
+	for (int i = 0; i < cmd->backoff && delay < max_restart_delay_ms; i ++) {
+		delay *= 2;
+	}
+	if (delay > max_restart_delay_ms) {
+		delay = max_restart_delay_ms;
+	}
+	// Somewhere between half and the full delay.
+	delay = delay / 2 + (long)restart_jitter((unsigned long)(delay - delay / 2) + 1);
+	if (delay == 0) {
+		delay = 1; // 0 would disarm the timer
+	}
+	cmd->backoff ++;
+	cmd->restarts ++;
+	if (cmd->restart_timer.fd == -1) {
+		cmd->restart_timer.fd = create_timer();
+		add_event_source(&cmd->restart_timer, EPOLLIN);
+	}
+	if (is_standby(-1)) {
+		// Fail over right away; the delay applies to the next standby.
+		LOGf("Failing over %s to its standby (restart %d).", cmd->argv[0], cmd->restarts);
+		standby_prespawn_ms = delay;
+		delay = 1;
+	} else {
+		LOGf("Restarting %s in %ldms (restart %d).", cmd->argv[0], delay, cmd->restarts);
+	}
+	arm_timer(cmd->restart_timer.fd, delay);
+	restarts_pending ++;
+	if (terminate_orphans_on_restart) {
+		terminate_orphans();
+	}
+	return 1;
+}
 
-static volatile sig_atomic_t shutdown_in_progress = 0;
+static void start_command(struct command* cmd) {
+	cmd->pid = is_standby(-1) ? promote_standby(standby_prespawn_ms) : launch_command(cmd->argv, 0);
+	cmd->running = 1;
+	cmd->started_ns = now_ns();
+	command_running ++;
+	if (cmd->pid == -1) {
+		// Counts as a failed run, which may well be restarted.
+		command_finished(cmd, (launch_exit_code & 0xff) << 8);
+		return;
+	}
+	if (cmd == &commands[0]) {
+		command_pid = cmd->pid;
+	}
+	if (use_pidfd || probe_address != NULL) {
+		open_command_pidfd(cmd);
+	}
+	if (cmd == &commands[0]) {
+		start_readiness_tracking();
+	}
+}
 
-static void start_shutdown() {
-	if (shutdown_in_progress) {
-		VERBOSE("Shutdown already in progress.");
+static void handle_restart_timer(struct event_source* src, uint32_t events) {
+	if (read_timer(src->fd) == 0) {
 		return;
 	}
-	shutdown_in_progress = 1;
-	// send SIGTERM to all kids, then start the death clock.
-	LOG("Terminating children...");
-	send_signal_to_all_children(SIGTERM);
+	struct command* cmd = (struct command*)((char*)src - offsetof(struct command, restart_timer));
+	restarts_pending --;
+	start_command(cmd);
+}
 
-	VERBOSE("tick tock...");
-	alarm(shutdown_timeout_seconds);
+// On shutdown, commands waiting for their restart stay down.
+static void cancel_restarts() {
+	if (restarts_pending == 0) {
+		return;
+	}
+	for (int i = 0; i < num_commands; i ++) {
+		if (commands[i].restart_timer.fd != -1) {
+			arm_timer(commands[i].restart_timer.fd, 0);
+		}
+	}
+	restarts_pending = 0;
+	// Nothing else may be left, and then no SIGCHLD would tell us.
+	reap_children();
 }
 
-// Note: called from signal handler.
-static void handle_alarm() {
-	// We receive this signal because we set the alarm after getting
-	// a termination request, and we timeouted. So here we exit
-	// right away.
-	if  (shutdown_in_progress) {
-		LOG("Shutdown timeout. Terminating.");
-		exit(-1);
+////////////////// standby ////////////////////////////////////
+
+// --standby[=barrier|exec[:<sig>]]: with --restart, we keep a second instance
+// of the command ready, so that a restart does not have to wait for the
+// command's startup. With "barrier" (the default), the standby is forked and
+// set up (cgroup, output relay, scheduling) and then waits before exec; with
+// "exec", it is exec'd with TINYREAPER_STANDBY=<sig> in its environment and
+// is expected to initialize and wait for <sig> (default: CONT, so it may just
+// stop itself). When the command exits and is to be restarted, the standby is
+// released right away and becomes the command; the next standby is prespawned
+// after the restart delay. Orphans of the old instance are reaped when they
+// exit, like always (or terminated with --restart-orphans=terminate).
+static pid_t standby_pid = -1;
+static long standby_retry_ms = 0; // backoff if the standby itself keeps failing
+
+static void handle_standby_timer(struct event_source* src, uint32_t events);
+static struct event_source standby_timer = { -1, handle_standby_timer };
+
+// Whether pid is the standby; with -1, whether there is one.
+static int is_standby(pid_t pid) {
+	return standby_pid != -1 && (pid == -1 || pid == standby_pid);
+}
+
+static void close_standby_barrier() {
+	for (int i = 0; i < 2; i ++) {
+		if (standby_barrier[i] != -1) {
+			close(standby_barrier[i]);
+			standby_barrier[i] = -1;
+		}
 	}
 }
 
-static void signal_handler(int sig, siginfo_t* siginfo, void* context) {
+// With --max-restarts, a standby is pointless once no restart is left.
+static int standby_needed() {
+	return max_restarts < 0 || commands[0].restarts < max_restarts;
+}
 
-	// Ignore SIGTERM send by myself to myself (see send_signal_to_all_children)
-	if (sig == SIGTERM && siginfo->si_pid == getpid()) {
-		VERBOSE("Ignoring SIGTERM sent by myself.");
+static void spawn_standby() {
+	if (!standby_needed()) {
+		VERBOSE("No restarts left, not starting a standby.");
 		return;
 	}
-	
-	if (verbose) {
-		WRITE_LITERAL_STRING("Signal: ");
-		write_num(sig);
-		WRITE_LITERAL_STRING("\n");
+	if (standby_mode == STANDBY_BARRIER && pipe2(standby_barrier, O_CLOEXEC) == -1) {
+		LOGf("Failed to create pipe - errno: %d (%s)", errno, strerror(errno));
+		return;
+	}
+	const int exit_code = launch_exit_code; // only the command's launches count
+	standby_pid = launch_command(commands[0].argv, 1);
+	launch_exit_code = exit_code;
+	if (standby_barrier[0] != -1) {
+		close(standby_barrier[0]); // the child's end
+		standby_barrier[0] = -1;
+	}
+	if (standby_pid == -1) {
+		close_standby_barrier();
+		return;
 	}
+	VERBOSEf("standby %d ready.", standby_pid);
+}
 
-	switch (sig) {
-		case SIGTERM:
-		case SIGINT:
-		case SIGQUIT:
-			start_shutdown();
-			break;
-		case SIGALRM:
-			handle_alarm();
-			break;			
+// Releases the standby, which becomes the command; returns its pid.
+static pid_t promote_standby(long prespawn_delay_ms) {
+	const pid_t pid = standby_pid;
+	standby_pid = -1;
+	untrack_orphan(pid); // with --pidfd, it may have been taken for one
+	if (standby_mode == STANDBY_BARRIER) {
+		const char go = 1;
+		while (write(standby_barrier[1], &go, 1) == -1 && errno == EINTR);
+		close_standby_barrier();
+	} else {
+		kill(pid, standby_go_signal);
 	}
+	standby_retry_ms = 0;
+	if (!standby_needed()) {
+		VERBOSEf("standby %d promoted, no restarts left for another.", pid);
+		return pid;
+	}
+	VERBOSEf("standby %d promoted, next one in %ldms.", pid, prespawn_delay_ms);
+	arm_timer(standby_timer.fd, prespawn_delay_ms > 0 ? prespawn_delay_ms : 1);
+	return pid;
 }
 
-static void initialize_signal_handler() {
-	struct sigaction sa;
-	sa.sa_sigaction = signal_handler;
-	sigemptyset(&(sa.sa_mask));
-	sa.sa_flags = SA_SIGINFO;
-	const int sigs[] = { SIGTERM, SIGINT, SIGQUIT, SIGALRM, -1 };
-	for (int i = 0; sigs[i] != -1; i ++) {
-		if (sigaction(sigs[i], &sa, NULL) == -1) {
-			LOGf("Failed to install signal handler for %d - errno: %d (%s)",
-			     sigs[i], errno, strerror(errno));
-		}
+// Called for every reaped child which is not a command; returns 1 if it was
+// the standby, which failed before it got promoted.
+static int standby_exited(pid_t pid) {
+	if (!is_standby(pid)) {
+		return 0;
+	}
+	standby_pid = -1;
+	close_standby_barrier();
+	if (shutdown_in_progress) {
+		return 1;
 	}
+	standby_retry_ms = standby_retry_ms == 0 ? restart_delay_ms : standby_retry_ms * 2;
+	if (standby_retry_ms > max_restart_delay_ms) {
+		standby_retry_ms = max_restart_delay_ms;
+	}
+	LOGf("Standby %d exited, starting another in %ldms.", (int)pid, standby_retry_ms);
+	arm_timer(standby_timer.fd, standby_retry_ms > 0 ? standby_retry_ms : 1);
+	return 1;
 }
 
-////////////////// misc stuff ////////////////////////////////////
+static void handle_standby_timer(struct event_source* src, uint32_t events) {
+	if (read_timer(src->fd) == 0) {
+		return;
+	}
+	if (!shutdown_in_progress && standby_pid == -1) {
+		spawn_standby();
+	}
+}
 
-// Make process a sub reaper for all direct and indirect children
-static void make_me_a_reaper() {
-	int rc = prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
-	if (rc == -1) {
-		LOGf("Failed to set sub reaper state - errno: %d (%s)", errno, strerror(errno));
-		LOG("Note: Will not adopt orphans.");
+static void initialize_standby() {
+	standby_timer.fd = create_timer();
+	add_event_source(&standby_timer, EPOLLIN);
+	spawn_standby();
+}
+
+// On shutdown, the standby is not needed anymore.
+static void cancel_standby() {
+	if (standby_timer.fd != -1) {
+		arm_timer(standby_timer.fd, 0);
 	}
+	if (standby_pid != -1) {
+		kill(standby_pid, SIGTERM);
+		kill(standby_pid, SIGCONT); // in case it stopped itself
+	}
+	close_standby_barrier(); // a waiting standby exits on EOF
 }
 
 ////////////////// main ////////////////////////////////////
 
+// Parses "<n>ms", "<n>s", "<n>m" or "<n>" (seconds); returns -1 if malformed.
+static long parse_duration_ms(const char* s) {
+	char* end;
+	errno = 0;
+	long n = strtol(s, &end, 10);
+	if (end == s || n < 0 || errno != 0) {
+		return -1;
+	}
+	if (strcmp(end, "ms") == 0) {
+		return n;
+	} else if (*end == '\0' || strcmp(end, "s") == 0) {
+		return n * 1000;
+	} else if (strcmp(end, "m") == 0) {
+		return n * 60 * 1000;
+	}
+	return -1;
+}
+
+// --events-fd, --events-file; see events
+static int events_fd = -1;
+
+// Handles "--name[=value]"; returns -1 if the option is unknown or malformed.
+static int parse_long_option(const char* option) {
+	const char* eq = strchr(option, '=');
+	const size_t namelen = eq ? (size_t)(eq - option) : strlen(option);
+	const char* value = eq ? eq + 1 : NULL;
+#define IS_OPTION(s) (namelen == sizeof(s) - 1 && strncmp(option, s, namelen) == 0)
+	if (IS_OPTION("pidfd") && value == NULL) {
+		use_pidfd = 1;
+		return 0;
+	}
+	if (IS_OPTION("cgroup") && value == NULL) {
+		use_cgroup = 1;
+		return 0;
+	}
+	if (IS_OPTION("grace") && value != NULL) {
+		return (grace_ms = parse_duration_ms(value)) < 0 ? -1 : 0;
+	}
+	if (IS_OPTION("stagger") && value != NULL) {
+		char* end;
+		stagger_batch = (int)strtol(value, &end, 10);
+		if (*end == ',') {
+			stagger_interval_ms = parse_duration_ms(end + 1);
+		} else if (*end != '\0') {
+			return -1;
+		}
+		return (stagger_batch > 0 && stagger_interval_ms >= 0) ? 0 : -1;
+	}
+	if (IS_OPTION("stagger-order") && value != NULL) {
+		if (strcmp(value, "leaves") == 0 || strcmp(value, "parents") == 0) {
+			stagger_leaves_first = strcmp(value, "leaves") == 0;
+			return 0;
+		}
+		return -1;
+	}
+	if (IS_OPTION("log-summary")) {
+		log_summary_ms = value ? parse_duration_ms(value) : 1000;
+		return log_summary_ms > 0 ? 0 : -1;
+	}
+	if (IS_OPTION("log-rate") && value != NULL) {
+		char* end;
+		log_rate = (int)strtol(value, &end, 10);
+		return (*end == '\0' && log_rate >= 0) ? 0 : -1;
+	}
+	if (IS_OPTION("metrics") && value != NULL) {
+		metrics_address = value;
+		return 0;
+	}
+	if (IS_OPTION("probe") && value != NULL) {
+		probe_address = value;
+		return 0;
+	}
+	if (IS_OPTION("ready-signal") && value != NULL) {
+		ready_signal = parse_signal(value);
+		// Signals with a meaning to us cannot double as readiness notification.
+		for (int i = 0; handled_signals[i] != -1; i ++) {
+			if (handled_signals[i] == ready_signal) {
+				return -1;
+			}
+		}
+		return (ready_signal > 0 && ready_signal != SIGKILL && ready_signal != SIGSTOP) ? 0 : -1;
+	}
+	if (IS_OPTION("notify") && value == NULL) {
+		use_notify = 1;
+		return 0;
+	}
+	if (IS_OPTION("notify-socket") && value != NULL) {
+		use_notify = 1;
+		notify_socket_path = value;
+		return 0;
+	}
+	if (IS_OPTION("watchdog") && value != NULL) {
+		use_notify = 1;
+		return (watchdog_ms = parse_duration_ms(value)) > 0 ? 0 : -1;
+	}
+	if (IS_OPTION("ready-file") && value != NULL) {
+		ready_file = value;
+		return 0;
+	}
+	if (IS_OPTION("wait-ready") && value == NULL) {
+		wait_ready = 1;
+		return 0;
+	}
+	if (IS_OPTION("stats-file") && value != NULL) {
+		stats_file = value;
+		return 0;
+	}
+	if (IS_OPTION("rusage")) {
+		char* end = NULL;
+		rusage_top = value ? (int)strtol(value, &end, 10) : 10;
+		return (end == NULL || *end == '\0') && rusage_top > 0 ? 0 : -1;
+	}
+	if (IS_OPTION("orphan-profile")) {
+		orphan_profile_ms = value ? parse_duration_ms(value) : 1000;
+		return orphan_profile_ms > 0 ? 0 : -1;
+	}
+	if (IS_OPTION("relay")) {
+		char* end = NULL;
+		relay_pipe_size = value ? strtol(value, &end, 10) : 1024 * 1024;
+		if (end != NULL && (*end == 'k' || *end == 'K')) {
+			relay_pipe_size *= 1024;
+			end ++;
+		} else if (end != NULL && (*end == 'm' || *end == 'M')) {
+			relay_pipe_size *= 1024 * 1024;
+			end ++;
+		}
+		return (end == NULL || *end == '\0') && relay_pipe_size > 0 && relay_pipe_size <= INT_MAX ? 0 : -1;
+	}
+	if (IS_OPTION("relay-tags") && value == NULL) {
+		relay_tags = 1;
+		return 0;
+	}
+	if (IS_OPTION("events-fd") && value != NULL) {
+		char* end;
+		long fd = strtol(value, &end, 10);
+		if (*end != '\0' || fd < 0 || fd > INT_MAX || fcntl((int)fd, F_GETFD) == -1) {
+			return -1;
+		}
+		fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+		events_fd = (int)fd;
+		return 0;
+	}
+	if (IS_OPTION("events-file") && value != NULL) {
+		events_fd = open(value, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (events_fd == -1) {
+			LOGf("Failed to open %s - errno: %d (%s)", value, errno, strerror(errno));
+		}
+		return events_fd == -1 ? -1 : 0;
+	}
+	if (IS_OPTION("pids-max") && value != NULL) {
+		char* end;
+		pids_max = strtol(value, &end, 10);
+		return (*end == '\0' && pids_max > 0) ? 0 : -1;
+	}
+	if (IS_OPTION("pid-pressure") && value != NULL) {
+		char* end;
+		pressure_max_descendants = (int)strtol(value, &end, 10);
+		if (*end == ',') {
+			const char* rate = end + 1;
+			pressure_max_rate = strtoul(rate, &end, 10);
+			if (end == rate) {
+				return -1;
+			}
+		}
+		return (*end == '\0' && pressure_max_descendants > 0) ? 0 : -1;
+	}
+	if (IS_OPTION("pid-pressure-time") && value != NULL) {
+		pressure_time_ms = parse_duration_ms(value);
+		return pressure_time_ms >= 0 ? 0 : -1;
+	}
+	if (IS_OPTION("pid-pressure-action") && value != NULL) {
+		if (strcmp(value, "log") == 0) {
+			pressure_action = PRESSURE_LOG;
+		} else if (strcmp(value, "stop") == 0) {
+			pressure_action = PRESSURE_STOP;
+		} else if (strcmp(value, "shutdown") == 0) {
+			pressure_action = PRESSURE_SHUTDOWN;
+		} else {
+			return -1;
+		}
+		return 0;
+	}
+	if (IS_OPTION("forward") && value != NULL) {
+		return parse_forward(value);
+	}
+	if (IS_OPTION("zombie-check") && value != NULL) {
+		zombie_check = 1;
+		char* end;
+		zombie_threshold = (int)strtol(value, &end, 10);
+		if (*end == ',') {
+			zombie_check_ms = parse_duration_ms(end + 1);
+		} else if (*end != '\0') {
+			return -1;
+		}
+		return (zombie_threshold >= 0 && zombie_check_ms > 0) ? 0 : -1;
+	}
+	if (IS_OPTION("report")) {
+		if (value == NULL) {
+			report_at_exit = REPORT_TEXT;
+		} else if (strcmp(value, "json") == 0) {
+			report_at_exit = REPORT_JSON;
+		} else {
+			return -1;
+		}
+		return 0;
+	}
+	if (IS_OPTION("on-exit") && value != NULL) {
+		if (strcmp(value, "shutdown") == 0) {
+			exit_policy = ON_EXIT_SHUTDOWN;
+		} else if (strcmp(value, "ignore") == 0) {
+			exit_policy = ON_EXIT_IGNORE;
+		} else {
+			return -1;
+		}
+		return 0;
+	}
+	if (IS_OPTION("restart") && value != NULL) {
+		if (strcmp(value, "no") == 0) {
+			restart_policy = RESTART_NO;
+		} else if (strcmp(value, "on-failure") == 0) {
+			restart_policy = RESTART_ON_FAILURE;
+		} else if (strcmp(value, "always") == 0) {
+			restart_policy = RESTART_ALWAYS;
+		} else {
+			return -1;
+		}
+		return 0;
+	}
+	if (IS_OPTION("max-restarts") && value != NULL) {
+		char* end;
+		max_restarts = (int)strtol(value, &end, 10);
+		return (*end == '\0' && max_restarts >= 0) ? 0 : -1;
+	}
+	if (IS_OPTION("restart-delay") && value != NULL) {
+		char buf[64];
+		format(buf, sizeof(buf), "%s", value);
+		char* comma = strchr(buf, ',');
+		if (comma != NULL) {
+			*comma = '\0';
+			max_restart_delay_ms = parse_duration_ms(comma + 1);
+		}
+		restart_delay_ms = parse_duration_ms(buf);
+		return (restart_delay_ms >= 0 && max_restart_delay_ms >= restart_delay_ms) ? 0 : -1;
+	}
+	if (IS_OPTION("restart-orphans") && value != NULL) {
+		if (strcmp(value, "keep") == 0 || strcmp(value, "terminate") == 0) {
+			terminate_orphans_on_restart = strcmp(value, "terminate") == 0;
+			return 0;
+		}
+		return -1;
+	}
+	if (IS_OPTION("standby")) {
+		if (value == NULL || strcmp(value, "barrier") == 0) {
+			standby_mode = STANDBY_BARRIER;
+			return 0;
+		}
+		if (strncmp(value, "exec", 4) == 0 && (value[4] == '\0' || value[4] == ':')) {
+			standby_mode = STANDBY_EXEC;
+			if (value[4] == ':') {
+				standby_go_signal = parse_signal(value + 5);
+			}
+			return standby_go_signal > 0 ? 0 : -1;
+		}
+		return -1;
+	}
+	if (IS_OPTION("reaper-cpus") && value != NULL) {
+		return parse_cpus(value, &reaper_sched);
+	}
+	if (IS_OPTION("reaper-sched") && value != NULL) {
+		return parse_sched(value, &reaper_sched);
+	}
+	if (IS_OPTION("reaper-nice") && value != NULL) {
+		return parse_nice(value, &reaper_sched);
+	}
+	if (IS_OPTION("cpus") && value != NULL) {
+		return parse_cpus(value, &command_sched);
+	}
+	if (IS_OPTION("sched") && value != NULL) {
+		return parse_sched(value, &command_sched);
+	}
+	if (IS_OPTION("nice") && value != NULL) {
+		return parse_nice(value, &command_sched);
+	}
+	if (IS_OPTION("numa") && value != NULL) {
+		return parse_numa(value);
+	}
+	if (IS_OPTION("kill")) {
+		kill_timeout_ms = value ? parse_duration_ms(value) : default_kill_timeout_ms;
+		return kill_timeout_ms < 0 ? -1 : 0;
+	}
+#undef IS_OPTION
+	return -1;
+}
+
 int main(int argc, char** argv) {
 	
 	// parse arguments
 	int start_command = -1;
+	int separated = 0;
 	for (int i = 1; i < argc && start_command == -1; i ++) {
-		if (argv[i][0] == '-') {
+		if (strcmp(argv[i], "--") == 0) {
+			start_command = i + 1;
+			separated = 1;
+			break;
+		} else if (strncmp(argv[i], "--", 2) == 0) {
+			if (parse_long_option(argv[i] + 2) == -1) {
+				LOGf("Unknown or malformed option: %s", argv[i]);
+				print_usage();
+				exit(-1);
+			}
+		} else if (argv[i][0] == '-') {
 			int len = (int)strlen(argv[i]);
 			if (len == 1) {
 				LOG("Missing option");
@@ -209,74 +4863,189 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	if (start_command == -1) {
+	if (start_command == -1 || start_command >= argc) {
 		LOG("Missing command");
 		print_usage();
 		exit(-1);
 	}
 
+	// Commands are NULL terminated argument vectors within argv: after an
+	// explicit "--", each further "--" starts another command.
+	commands[num_commands ++].argv = argv + start_command;
+	for (int i = start_command; separated && i < argc; i ++) {
+		if (strcmp(argv[i], "--") == 0) {
+			argv[i] = NULL;
+			if (i + 1 >= argc || strcmp(argv[i + 1], "--") == 0) {
+				LOG("Missing command");
+				print_usage();
+				exit(-1);
+			}
+			if (num_commands == MAX_COMMANDS) {
+				LOGf("Too many commands (max: %d)", MAX_COMMANDS);
+				exit(-1);
+			}
+			commands[num_commands ++].argv = argv + i + 1;
+		}
+	}
+	for (int i = 0; i < num_commands; i ++) {
+		commands[i].pidfd.fd = -1;
+		commands[i].pidfd.handler = handle_pidfd;
+		commands[i].restart_timer.fd = -1;
+		commands[i].restart_timer.handler = handle_restart_timer;
+	}
+	if (standby_mode != STANDBY_NO && (restart_policy == RESTART_NO || num_commands > 1)) {
+		LOG("--standby needs --restart and a single command.");
+		exit(-1);
+	}
+
+	if (wait_ready) {
+		detach_until_ready();
+	}
+
+	initialize_logging();
+	if (events_fd != -1) {
+		initialize_events(events_fd);
+	}
+
 	// Make me process group leader
 	setpgrp();
 
 	// Make us subreaper
 	make_me_a_reaper();
+
+	initialize_scheduling();
 	
-	// Init handler to handle SIGTERM and SIGINT
-	initialize_signal_handler();
-	
-	// assemble NULL-terminated argument vector for exec
-	int child_argc = argc - start_command;
-	char** child_argv = (char**) malloc((child_argc + 1) * sizeof(char*));
-	for (int i = start_command; i < argc; i ++) {
-		child_argv[i - start_command] = argv[i];
+	// Block signals we handle and route them, and our timer, through epoll.
+	// This must happen before fork so we cannot miss an early SIGCHLD.
+	initialize_event_loop();
+	initialize_signal_handling();
+	initialize_shutdown_timer();
+	if (stagger_batch > 0) {
+		initialize_stagger_timer();
+	}
+	if (log_summary_ms > 0) {
+		initialize_exit_summary();
+	}
+	if (metrics_address != NULL && (probe_address == NULL || strcmp(metrics_address, probe_address) != 0)) {
+		initialize_metrics(); // else served by the probe listener
+	}
+	if (probe_address != NULL) {
+		initialize_probe();
+	}
+	if (use_notify) {
+		initialize_notify();
+		atexit(remove_notify_socket);
+	}
+	if (stats_file != NULL) {
+		initialize_stats_page();
+	}
+	if (orphan_profile_ms > 0) {
+		initialize_orphan_profile();
+	}
+	if (relay_tags && relay_pipe_size == 0) {
+		relay_pipe_size = 1024 * 1024;
+	}
+	if (relay_pipe_size > 0) {
+		initialize_relay();
 	}
-	child_argv[child_argc] = NULL;
 
+	if (use_cgroup && initialize_cgroup() == -1) {
+		LOG("Note: Falling back to process group signalling.");
+		use_cgroup = 0;
+	}
+	if (use_cgroup && kill_timeout_ms < 0) {
+		kill_timeout_ms = default_kill_timeout_ms;
+	}
+	if (pids_max > 0) {
+		initialize_pids_max();
+	}
+	if (pressure_max_descendants > 0) {
+		initialize_pid_pressure();
+	}
+	if (zombie_check) {
+		initialize_zombie_check();
+	}
+	
 	VERBOSEf("tinyreaper (pid: %d, parent: %d, pgrp: %d)", getpid(), getppid(), getpgrp());
 
-	// fork, then exec <command>
-	command_pid = fork();
-
-	if (command_pid == 0) {
-		// --- Child ---
-		int rc = execv(child_argv[0], child_argv);
-		if (rc == -1) {
-			LOGf("Failed to exec \"%s\" - errno: %d (%s)",
-                             child_argv[0], errno, strerror(errno));
-			exit(-1);
-		}
-	} else {
-		// --- Parent ---
-		int command_status = 0;
-		for (;;) {
-			int status;
-			pid_t child = wait(&status);
-			if (child > 0) {
-				LOG_process_state(child, status);
-				if (child == command_pid) {
-					VERBOSEf("%s finished.", child_argv[0]);
-					command_status = status;
-					// The command finished.
-					// We now terminate any remaining children and continue to wait
-					// until they finish too. We also set a death clock. If all children
-					// finish in time, or if there are no remaining children, we will leave
-					// the loop and exit. If children remain, we will eventually run out of
-					// time and terminate ourselves.
-					start_shutdown();
-				}
-			} else if (child == (pid_t) -1 && errno == ECHILD) {
-				VERBOSE("all child processes terminated.");
+	if (use_cgroup) {
+		atexit(remove_cgroup);
+	}
+	int launch_failed = 0;
+	for (int i = 0; i < num_commands; i ++) {
+		commands[i].pid = launch_command(commands[i].argv, 0);
+		commands[i].started_ns = now_ns();
+		if (commands[i].pid == -1 && restart_policy != RESTART_NO) {
+			// Counts as a failed run, like in start_command().
+			commands[i].running = 1;
+			command_running ++;
+			command_finished(&commands[i], (launch_exit_code & 0xff) << 8);
+			if (shutdown_in_progress) {
 				break;
 			}
+			continue;
 		}
+		if (commands[i].pid == -1) {
+			if (i == 0) {
+				enter_finished_phase();
+				exit(launch_exit_code);
+			}
+			launch_failed = 1;
+			break; // shut down those we started
+		}
+		commands[i].running = 1;
+		command_running ++;
+	}
+	command_pid = commands[0].pid;
+	if (restart_policy == RESTART_NO) {
+		close_relay_write_ends(); // no more commands get started
+	}
+	if (use_pidfd || probe_address != NULL) {
+		initialize_command_pidfds();
+	}
+	if (use_pidfd) {
+		limit_orphan_pidfds();
+	}
+	if (commands[0].running) {
+		start_readiness_tracking(); // else once it restarts
+	}
+	if (launch_failed) {
+		start_shutdown();
+	} else if (standby_mode != STANDBY_NO && !shutdown_in_progress) {
+		initialize_standby();
+	}
+	// Children may have exited before we got here; reap once, then wait
+	// for events. Their latency counts from here.
+	events_observed_ns = now_ns();
+	reap_children();
+	run_event_loop();
+	enter_finished_phase();
+	if (report_at_exit == REPORT_JSON) {
+		log_json_report();
+	} else if (report_at_exit) {
+		log_reports();
+	} else {
+		// --rusage and --orphan-profile report at exit in any case
+		log_rusage();
+		log_orphan_profile();
+	}
 
-		// We return -1 if <command> was terminated by signal, or if its exit status was != 0
-		int rc = ((WIFEXITED(command_status) && WEXITSTATUS(command_status) != 0) || 
-		           WIFSIGNALED(command_status)) ? -1 : 0;
-		VERBOSEf("Returning %d", rc);
-
-		exit(rc);
+	// We return -1 if a command was terminated by signal, or if its exit status was != 0;
+	// unless we stopped it ourselves because another command exited.
+	int rc = 0;
+	for (int i = 0; i < num_commands; i ++) {
+		const int status = commands[i].status;
+		if (commands[i].pid != -1 && !commands[i].stopped &&
+		    ((WIFEXITED(status) && WEXITSTATUS(status) != 0) || WIFSIGNALED(status))) {
+			rc = -1;
+		}
 	}
+	if (shutdown_failed) {
+		rc = shutdown_timeout_exit_code;
+	} else if (launch_exit_code != 0) {
+		rc = launch_exit_code;
+	}
+	VERBOSEf("Returning %d", rc);
 
-	return 0;
+	exit(rc);
 }